@@ -3,19 +3,39 @@
 
 #include "materials/material.hpp"
 #include "objects/bvh.hpp"
+#include "objects/bvh_snapshot.hpp"
 #include "objects/hit_record.hpp"
 #include "objects/hittable.hpp"
+#include "objects/instance.hpp"
+#include "objects/lbvh.hpp"
+#include "objects/sbvh.hpp"
 #include "objects/sphere.hpp"
 #include "objects/triangle.hpp"
+#include "objects/wide_bvh.hpp"
 #include "scene/camera.hpp"
+#include "scene/distributed.hpp"
 #include "scene/scene.hpp"
+#include "util/checkpoint.hpp"
+#include "util/interrupt.hpp"
 #include "util/output_image.hpp"
+#include "util/perf_counter.hpp"
 #include "util/piecewise_linear.hpp"
 #include "util/random.hpp"
 #include "util/spectral_conversion.hpp"
 
-std::shared_ptr<Hittable> random_scene() {
-  RNG random;
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <glm/gtc/matrix_transform.hpp>
+#include <optional>
+
+// Maps the BVH from the snapshot at snapshot_path, if given and up to date
+std::shared_ptr<BVHFlatTree>
+random_scene(const std::string &snapshot_path = "",
+             const BVHBuilder builder = BVHBuilder::SAH) {
+  MersenneRNG random;
   std::shared_ptr<HittableList> world = std::make_shared<HittableList>();
 
   const auto ground_material =
@@ -64,7 +84,37 @@ std::shared_ptr<Hittable> random_scene() {
       ReflectiveMaterial(Colour(0.7, 0.6, 0.5), 0.0));
   world->emplace<Sphere>(vec3(4, 1, 0), 1.0, material3);
 
-  return std::make_shared<BVHFlatTree>(world->objects);
+  if (!snapshot_path.empty())
+    return load_or_build_bvh(world->objects, snapshot_path, builder);
+  return build_bvh(world->objects, builder);
+}
+
+Camera random_scene_camera() {
+  Camera camera(vec3(13.0, 2.0, 3.0), vec3(0.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0),
+                0.05);
+  camera.vertical_fov = 25;
+  return camera;
+}
+
+Camera load_random_scene(Scene &scene,
+                         const BVHBuilder builder = BVHBuilder::SAH) {
+  scene.add(random_scene("", builder));
+  return random_scene_camera();
+}
+
+// Scenes workers can build by name when a coordinator asks for them, with the
+// given BVH builder. Given a snapshot_dir, their BVHs are kept as snapshots
+// there between runs.
+SceneRegistry scene_registry(const std::string &snapshot_dir = "",
+                             const BVHBuilder builder = BVHBuilder::SAH) {
+  const auto snapshot_path = [snapshot_dir](const std::string &name) {
+    return snapshot_dir.empty() ? std::string()
+                                : snapshot_dir + "/" + name + ".bvh";
+  };
+  return {{"random", [=](Scene &scene) {
+             scene.add(random_scene(snapshot_path("random"), builder));
+             return random_scene_camera();
+           }}};
 }
 
 void render_spectral() {
@@ -136,18 +186,1031 @@ void render_earth() {
   scene.just_render(camera, image, 100, 100);
 }
 
-void render() {
+// What the render subcommand was asked to do
+struct RenderOptions {
+  bool resume = false;
+  // Which disjoint range of each pixel's samples this process traces
+  size_t shard = 0, num_shards = 1;
+  bool ray_packets = false;
+  BVHBuilder builder = BVHBuilder::SAH;
+  // Spend the same average budget with Scene::render_adaptive instead
+  bool adaptive = false;
+  bool wavefront = false;
+  // Render for this long with Scene::render_for instead, if positive
+  real time_budget_seconds = 0.0;
+};
+
+// Renders shard `shard` of `num_shards` of the frame: every shard traces a
+// disjoint range of each pixel's samples, and leaves its accumulators in a
+// checkpoint for merge_shards to combine
+void render(const RenderOptions &options) {
+  constexpr size_t samples_per_pixel = 100;
+  constexpr size_t max_depth = 100;
   RGBImage image(1200, 800);
-  RGBVarianceImage variance_image(image.m_width, image.m_height);
-  const vec3 camera_position(13.0, 2.0, 3.0);
-  const vec3 camera_target(0.0, 0.0, 0.0);
-  Camera camera(camera_position, camera_target, vec3(0.0, 1.0, 0.0), 0.05);
-  camera.vertical_fov = 25;
+  Scene scene;
+  Camera camera = load_random_scene(scene, options.builder);
   camera.set_output_image(image);
 
+  RenderSettings settings;
+  settings.ray_packets = options.ray_packets;
+  if (options.wavefront)
+    settings.integrator = Integrator::Wavefront;
+  if (options.adaptive) {
+    AdaptiveSettings adaptive;
+    adaptive.average_samples_per_pixel = samples_per_pixel;
+    scene.render_adaptive(camera, image, adaptive, max_depth, settings);
+    return;
+  }
+  if (options.time_budget_seconds > 0.0) {
+    install_interrupt_handlers();
+    const TimedRenderResult result = scene.render_for(
+        camera, image, options.time_budget_seconds, max_depth, settings);
+    fmt::println("Reached {:.2f} samples per pixel within a {:.2f} second "
+                 "budget (min {}, max {})",
+                 result.average_samples_per_pixel, options.time_budget_seconds,
+                 result.min_samples_per_pixel, result.max_samples_per_pixel);
+    return;
+  }
+
+  const size_t first_sample =
+      options.shard * samples_per_pixel / options.num_shards;
+  const size_t end_sample =
+      (options.shard + 1) * samples_per_pixel / options.num_shards;
+  settings.checkpoint_path =
+      options.num_shards == 1
+          ? "output/checkpoint.bin"
+          : fmt::format("output/shard_{}.bin", options.shard);
+  settings.resume = options.resume;
+  settings.first_sample = first_sample;
+  install_interrupt_handlers();
+
+  scene.render(camera, image, end_sample - first_sample, max_depth, settings);
+}
+
+// Hands the tiles of the named scene out to workers connecting to address
+int coordinate(const std::string &address, const std::string &scene_name) {
+  if (!scene_registry().contains(scene_name)) {
+    fmt::println("Unknown scene '{}'", scene_name);
+    return 1;
+  }
+  RGBImage image(1200, 800);
+  RenderJob job;
+  job.scene = scene_name;
+  job.pixel_type = RGBPixel::type_id;
+  job.width = image.m_width;
+  job.height = image.m_height;
+  job.samples_per_pixel = 100;
+  job.max_depth = 100;
+  install_interrupt_handlers();
+
+  if (!coordinate_render(address, job, image)) {
+    fmt::println("Interrupted before every tile was rendered");
+    return 1;
+  }
+  image.write_png("output/result.png");
+  image.write_png("public_output/result.png");
+  return 0;
+}
+
+// Reports the random scene's BVH statistics, and how much work tracing camera
+// rays and incoherent rays through it takes. With json_path, also writes them
+// there as JSON.
+void report_stats(const std::string &json_path) {
+  constexpr size_t num_rays = 1 << 20;
+  const std::shared_ptr<BVHFlatTree> bvh = random_scene();
+  const BVHStats bvh_stats(*bvh);
+  fmt::println("{}", bvh_stats.report());
+  Camera camera = random_scene_camera();
+  camera.image_width = 1200;
+  camera.image_height = 800;
+  camera.update_constants();
+
+  RNG random = RNG::for_sample(0, 0, 0);
+  const auto trace = [&](const auto &make_ray) {
+    TraversalStats::reset();
+    for (size_t i = 0; i < num_rays; ++i) {
+      HitRecord record;
+      bvh->hit(make_ray(), 0.0001, INFINITY, record);
+    }
+    return TraversalStats::total();
+  };
+  const TraversalStats camera_stats = trace([&]() {
+    const vec2 pixel(random.random_real(0.0, camera.image_width),
+                     random.random_real(0.0, camera.image_height));
+    return camera.get_ray(pixel, random);
+  });
+  const TraversalStats incoherent_stats = trace([&]() {
+    const vec3 origin(random.random_real(-11.0, 11.0),
+                      random.random_real(0.0, 2.0),
+                      random.random_real(-11.0, 11.0));
+    return Ray(origin, random.random_unit_vec3());
+  });
+
+  if constexpr (SPECTRAL_TRAVERSAL_STATS) {
+    fmt::println("Camera rays: {}", camera_stats.report());
+    fmt::println("Incoherent rays: {}", incoherent_stats.report());
+  } else {
+    fmt::println("Traversal statistics are compiled out of this build; "
+                 "configure with -DSPECTRAL_TRAVERSAL_STATS=ON");
+  }
+  if (json_path.empty())
+    return;
+  std::ofstream os(json_path);
+  os << fmt::format("{{\"bvh\": {}, \"camera_rays\": {}, "
+                    "\"incoherent_rays\": {}}}\n",
+                    bvh_stats.json(), camera_stats.json(),
+                    incoherent_stats.json());
+  fmt::println("Wrote statistics to '{}'", json_path);
+}
+
+// How long tracing a set of rays took, and what each one hit first
+struct TracedHits {
+  real seconds = 0.0;
+  std::vector<real> distances;
+  std::vector<const Material *> materials;
+
+  real mrays_per_second() const { return distances.size() / seconds / 1e6; }
+
+  // How many rays hit a different material or at a different distance than
+  // in reference. Distances within tolerance of each other, relative to the
+  // reference's, count as the same.
+  size_t mismatches(const TracedHits &reference,
+                    const real tolerance = 0.0) const {
+    size_t num_mismatches = 0;
+    for (size_t i = 0; i < distances.size(); ++i) {
+      const real t = distances[i], t_reference = reference.distances[i];
+      num_mismatches += materials[i] != reference.materials[i] ||
+                        (t != t_reference &&
+                         !(std::abs(t - t_reference) <=
+                           tolerance * std::max(real(1.0), t_reference)));
+    }
+    return num_mismatches;
+  }
+};
+
+// Traces every ray with trace(ray, record), timing the whole pass
+template <typename Trace>
+TracedHits trace_hits(const std::vector<Ray> &rays, const Trace &trace) {
+  TracedHits hits;
+  hits.distances.resize(rays.size());
+  hits.materials.resize(rays.size());
+  const Timer timer;
+  for (size_t i = 0; i < rays.size(); ++i) {
+    HitRecord record;
+    record.material = nullptr;
+    trace(rays[i], record);
+    hits.distances[i] = record.t;
+    hits.materials[i] = record.material;
+  }
+  hits.seconds = timer.elapsed_seconds();
+  return hits;
+}
+
+// A trace_hits() tracer through the tree's own closest-hit query
+template <typename Tree> auto closest_hit(const Tree &tree) {
+  return [&tree](const Ray &ray, HitRecord &record) {
+    tree.hit(ray, 0.0001, INFINITY, record);
+  };
+}
+
+// Two ways of tracing the same rays, each timed, and how many of the
+// candidate's hits differ from the reference's
+struct HitComparison {
+  TracedHits reference, candidate;
+  size_t num_mismatches = 0;
+
+  // How many times as fast the candidate traced the rays
+  real speedup() const { return reference.seconds / candidate.seconds; }
+};
+
+template <typename Reference, typename Candidate>
+HitComparison compare_hits(const std::vector<Ray> &rays,
+                           const Reference &reference,
+                           const Candidate &candidate,
+                           const real tolerance = 0.0) {
+  HitComparison comparison;
+  comparison.reference = trace_hits(rays, reference);
+  comparison.candidate = trace_hits(rays, candidate);
+  comparison.num_mismatches =
+      comparison.candidate.mismatches(comparison.reference, tolerance);
+  return comparison;
+}
+
+// num_spheres small spheres scattered uniformly through a cube, at the density
+// of one per unit volume
+std::vector<std::shared_ptr<Sphere>>
+random_sphere_field(const size_t num_spheres, MersenneRNG &random) {
+  const auto material =
+      std::make_shared<Material>(DiffuseMaterial(Colour(0.5, 0.5, 0.5)));
+  const real half_size = std::cbrt(static_cast<real>(num_spheres));
+  std::vector<std::shared_ptr<Sphere>> spheres;
+  for (size_t i = 0; i < num_spheres; ++i)
+    spheres.push_back(std::make_shared<Sphere>(
+        random.random_vec3(-half_size, half_size), random.random_real(0.1, 0.5),
+        material));
+  return spheres;
+}
+
+// num_triangles long, thin triangles at random orientations through a cube,
+// like the slivers architectural models are full of
+std::vector<std::shared_ptr<Hittable>>
+random_sliver_field(const size_t num_triangles, MersenneRNG &random) {
+  const auto material =
+      std::make_shared<Material>(DiffuseMaterial(Colour(0.5, 0.5, 0.5)));
+  const real half_size = std::cbrt(static_cast<real>(num_triangles));
+  std::vector<std::shared_ptr<Hittable>> triangles;
+  for (size_t i = 0; i < num_triangles; ++i) {
+    const vec3 a = random.random_vec3(-half_size, half_size);
+    const vec3 b =
+        a + random.random_real(0.0, 8.0) * random.random_unit_vec3();
+    const vec3 c = a + real(0.1) * random.random_unit_vec3();
+    triangles.push_back(std::make_shared<Triangle>(a, b, c, material));
+  }
+  return triangles;
+}
+
+// num_rays rays in uniformly random directions from uniformly random points
+// of the cube of the given half size around the origin
+std::vector<Ray> random_rays(const size_t num_rays, const real half_size,
+                             MersenneRNG &random) {
+  std::vector<Ray> rays;
+  for (size_t i = 0; i < num_rays; ++i)
+    rays.emplace_back(random.random_vec3(-half_size, half_size),
+                      random.random_unit_vec3());
+  return rays;
+}
+
+// What most benchmarks trace: a field of random spheres and slivers, and
+// random rays through it. Benchmarks needing more at random keep drawing from
+// random.
+struct BenchmarkScene {
+  MersenneRNG random;
+  real half_size = 0.0;
+  std::vector<std::shared_ptr<Sphere>> spheres;
+  std::vector<std::shared_ptr<Hittable>> primitives;
+  std::vector<Ray> rays;
+};
+
+BenchmarkScene benchmark_scene(const size_t num_spheres,
+                               const size_t num_slivers,
+                               const size_t num_rays) {
+  BenchmarkScene scene;
+  scene.half_size = std::cbrt(static_cast<real>(num_spheres + num_slivers));
+  scene.spheres = random_sphere_field(num_spheres, scene.random);
+  scene.primitives = random_sliver_field(num_slivers, scene.random);
+  scene.primitives.insert(scene.primitives.end(), scene.spheres.begin(),
+                          scene.spheres.end());
+  scene.rays = random_rays(num_rays, scene.half_size, scene.random);
+  return scene;
+}
+
+// Times BVHFlatTree's traversal kernels and the wide BVHs collapsed from it
+// against each other, on camera rays and on incoherent rays between random
+// points in the scene
+void benchmark_traversal() {
+  constexpr size_t num_rays = 1 << 20;
+  const std::shared_ptr<BVHFlatTree> bvh = random_scene();
+  const BVH4 bvh4(*bvh);
+  const BVH8 bvh8(*bvh);
+  fmt::println("BVHFlatTree: {} nodes of {} bytes, {:.1f} KiB",
+               bvh->nodes.size(), sizeof(BVHFlatTree::BVHNode),
+               bvh->nodes.size() * sizeof(BVHFlatTree::BVHNode) / 1024.0);
+  Camera camera = random_scene_camera();
+  camera.image_width = 1200;
+  camera.image_height = 800;
+  camera.update_constants();
+
+  RNG random = RNG::for_sample(0, 0, 0);
+  std::vector<Ray> camera_rays, incoherent_rays;
+  for (size_t i = 0; i < num_rays; ++i) {
+    const vec2 pixel(random.random_real(0.0, camera.image_width),
+                     random.random_real(0.0, camera.image_height));
+    camera_rays.push_back(camera.get_ray(pixel, random));
+    const vec3 origin(random.random_real(-11.0, 11.0),
+                      random.random_real(0.0, 2.0),
+                      random.random_real(-11.0, 11.0));
+    incoherent_rays.emplace_back(origin, random.random_unit_vec3());
+  }
+
+  // Every kernel is checked against the recursive one
+  const auto run = [](const std::string_view name,
+                      const std::vector<Ray> &rays, const auto &trace,
+                      const TracedHits &recursive) {
+    const TracedHits hits = trace_hits(rays, trace);
+    fmt::println("  {:<10} {:8.2f} Mrays/s, {} of {} closest hits differ",
+                 name, hits.mrays_per_second(), hits.mismatches(recursive),
+                 rays.size());
+  };
+
+  for (const auto &[name, rays] :
+       {std::make_pair("camera", &camera_rays),
+        std::make_pair("incoherent", &incoherent_rays)}) {
+    fmt::println("{} rays:", name);
+    const TracedHits recursive =
+        trace_hits(*rays, [&](const Ray &ray, HitRecord &record) {
+          bvh->recursive_hit(ray, 0.0001, INFINITY, record, 0);
+        });
+    fmt::println("  {:<10} {:8.2f} Mrays/s", "recursive",
+                 recursive.mrays_per_second());
+    run(
+        "iterative", *rays,
+        [&](const Ray &ray, HitRecord &record) {
+          bvh->iterative_hit(ray, 0.0001, INFINITY, record);
+        },
+        recursive);
+    run("bvh4", *rays, closest_hit(bvh4), recursive);
+    run("bvh8", *rays, closest_hit(bvh8), recursive);
+  }
+}
+
+// Times shadow-ray style visibility tests between random points of the random
+// scene, answered by closest-hit queries and by occlusion queries
+void benchmark_occlusion() {
+  constexpr size_t num_queries = 1 << 20;
+  const std::shared_ptr<BVHFlatTree> bvh = random_scene();
+
+  RNG random = RNG::for_sample(0, 0, 0);
+  std::vector<std::pair<Ray, real>> segments;
+  for (size_t i = 0; i < num_queries; ++i) {
+    const vec3 from(random.random_real(-11.0, 11.0),
+                    random.random_real(0.0, 2.0),
+                    random.random_real(-11.0, 11.0));
+    const vec3 to(random.random_real(-11.0, 11.0), random.random_real(0.0, 2.0),
+                  random.random_real(-11.0, 11.0));
+    segments.emplace_back(Ray(from, to - from), glm::length(to - from));
+  }
+
+  const auto run = [&](const std::string_view name, const auto &blocked) {
+    std::vector<uint8_t> results(segments.size());
+    const Timer timer;
+    for (size_t i = 0; i < segments.size(); ++i)
+      results[i] = blocked(segments[i].first, segments[i].second);
+    const real elapsed_seconds = timer.elapsed_seconds();
+    fmt::println("  {:<12} {:8.2f} Mrays/s, {} of {} blocked", name,
+                 segments.size() / elapsed_seconds / 1e6,
+                 std::count(results.begin(), results.end(), 1),
+                 segments.size());
+    return results;
+  };
+
+  fmt::println("Visibility between random points:");
+  const std::vector<uint8_t> closest =
+      run("closest-hit", [&](const Ray &ray, const real distance) {
+        HitRecord record;
+        return bvh->hit(ray, 0.0001, distance, record);
+      });
+  const std::vector<uint8_t> any =
+      run("occluded", [&](const Ray &ray, const real distance) {
+        return bvh->occluded(ray, 0.0001, distance);
+      });
+  fmt::println("  {} of {} answers differ",
+               std::inner_product(closest.begin(), closest.end(), any.begin(),
+                                  size_t(0), std::plus<>(),
+                                  std::not_equal_to<>()),
+               segments.size());
+}
+
+// Builds BVHs over a field of num_spheres random spheres with the SAH builder
+// and the linear builder, with and without treelet restructuring, and compares
+// their build times, SAH costs and traversal speed on incoherent rays
+void benchmark_builders(const size_t num_spheres) {
+  const BenchmarkScene scene = benchmark_scene(num_spheres, 0, 1 << 18);
+
+  TracedHits reference;
+  const auto run = [&](const std::string_view name, const auto &build) {
+    const Timer build_timer;
+    const BVHFlatTree bvh = build();
+    const real build_seconds = build_timer.elapsed_seconds();
+
+    const TracedHits hits = trace_hits(scene.rays, closest_hit(bvh));
+    if (reference.distances.empty())
+      reference = hits;
+
+    fmt::println("{:<12} build {:7.3f} s, SAH cost {:7.2f}, {} nodes, depth "
+                 "{}, {:6.2f} Mrays/s, {} hits differ",
+                 name, build_seconds, bvh.sah_cost(), bvh.nodes.size(),
+                 bvh.depth, hits.mrays_per_second(),
+                 hits.mismatches(reference));
+  };
+
+  run("sah", [&]() { return BVHFlatTree(scene.primitives); });
+  run("lbvh", [&]() { return BVHFlatTree(LinearBVH(scene.primitives)); });
+  run("lbvh+treelet",
+      [&]() { return BVHFlatTree(LinearBVH(scene.primitives, 3)); });
+}
+
+// Traces rays through a BVH over num_spheres random spheres as built, and
+// after reorder_for_cache(), counting hardware cache and TLB misses where the
+// system exposes them. Parallel rays sweeping across the field in scanline
+// order stand in for camera rays.
+void benchmark_layout(const size_t num_spheres) {
+  constexpr size_t num_rays = 1 << 20;
+  BenchmarkScene scene = benchmark_scene(num_spheres, 0, num_rays);
+  const real half_size = scene.half_size;
+  const BVHFlatTree depth_first(scene.primitives);
+  BVHFlatTree reordered = depth_first;
+  reordered.reorder_for_cache();
+  fmt::println("{:.1f} MiB of nodes",
+               depth_first.nodes.size() * sizeof(BVHFlatTree::BVHNode) /
+                   1048576.0);
+
+  std::vector<Ray> coherent_rays;
+  const size_t side = std::sqrt(static_cast<real>(num_rays));
+  for (size_t i = 0; i < num_rays; ++i) {
+    const vec3 origin(-half_size - 1.0,
+                      ((i / side) / real(side) * 2.0 - 1.0) * half_size,
+                      ((i % side) / real(side) * 2.0 - 1.0) * half_size);
+    coherent_rays.emplace_back(origin, vec3(1.0, 0.0, 0.0));
+  }
+
+  PerfCounter cache_misses = PerfCounter::cache_misses();
+  PerfCounter tlb_misses = PerfCounter::tlb_misses();
+  const auto per_ray = [](const std::optional<uint64_t> count,
+                          const size_t num_rays) {
+    return count.has_value()
+               ? fmt::format("{:6.2f}", static_cast<real>(*count) / num_rays)
+               : std::string("   n/a");
+  };
+  const auto run = [&](const std::string_view name, const BVHFlatTree &bvh,
+                       const std::vector<Ray> &rays) {
+    cache_misses.start();
+    tlb_misses.start();
+    TracedHits hits = trace_hits(rays, closest_hit(bvh));
+    const std::optional<uint64_t> cache_count = cache_misses.stop();
+    const std::optional<uint64_t> tlb_count = tlb_misses.stop();
+    fmt::println("  {:<12} {:6.2f} Mrays/s, cache misses/ray {}, TLB "
+                 "misses/ray {}",
+                 name, hits.mrays_per_second(),
+                 per_ray(cache_count, rays.size()),
+                 per_ray(tlb_count, rays.size()));
+    return hits;
+  };
+
+  for (const auto &[name, rays] :
+       {std::make_pair("coherent", &coherent_rays),
+        std::make_pair("incoherent", &scene.rays)}) {
+    fmt::println("{} rays:", name);
+    const TracedHits before = run("depth-first", depth_first, *rays);
+    const TracedHits after = run("blocked", reordered, *rays);
+    fmt::println("  {} of {} closest hits differ", after.mismatches(before),
+                 rays->size());
+  }
+  if (!cache_misses.available() || !tlb_misses.available())
+    fmt::println("Hardware counters are unavailable on this system");
+}
+
+// Compares a spatial split BVH against the SAH builder's object split BVH
+// over a field of num_triangles slivers, at a few duplication budgets
+void benchmark_sbvh(const size_t num_triangles) {
+  const BenchmarkScene scene = benchmark_scene(0, num_triangles, 1 << 18);
+
+  TracedHits reference;
+  const auto run = [&](const std::string_view name, const auto &build) {
+    const Timer build_timer;
+    const BVHFlatTree bvh = build();
+    const real build_seconds = build_timer.elapsed_seconds();
+
+    TraversalStats::reset();
+    const TracedHits hits = trace_hits(scene.rays, closest_hit(bvh));
+    const TraversalStats traversal = TraversalStats::total();
+    if (reference.distances.empty())
+      reference = hits;
+
+    fmt::println("{:<10} build {:7.3f} s, SAH cost {:7.2f}, {:.2f} references "
+                 "per primitive, {:6.2f} Mrays/s ({:.2f}x), {} hits differ",
+                 name, build_seconds, bvh.sah_cost(),
+                 static_cast<real>(bvh.primitives.size()) / num_triangles,
+                 hits.mrays_per_second(), reference.seconds / hits.seconds,
+                 hits.mismatches(reference));
+    if constexpr (SPECTRAL_TRAVERSAL_STATS)
+      fmt::println("{:<10} {}", "", traversal.report());
+  };
+
+  run("object", [&]() { return BVHFlatTree(scene.primitives); });
+  for (const real max_duplication : {1.25, 1.5, 2.0})
+    run(fmt::format("sbvh {:.2f}", max_duplication), [&]() {
+      return BVHFlatTree(SpatialSplitBVH(scene.primitives, max_duplication));
+    });
+}
+
+// Traces random rays through a mix of spheres and triangles, testing leaves
+// against BVHFlatTree's packed primitive arrays and then, with every leaf
+// retagged as generic, through the virtual Hittable interface
+void benchmark_packing(const size_t num_primitives) {
+  const BenchmarkScene scene = benchmark_scene(
+      num_primitives / 2, num_primitives - num_primitives / 2, 1 << 20);
+
+  const BVHFlatTree packed(scene.primitives);
+  BVHFlatTree generic = packed;
+  size_t num_leaves = 0, num_generic_leaves = 0;
+  for (BVHFlatTree::BVHNode &node : generic.nodes) {
+    if (!node.is_leaf())
+      continue;
+    ++num_leaves;
+    num_generic_leaves += node.leaf_type == BVHFlatTree::LeafType::Generic;
+    node.leaf_type = BVHFlatTree::LeafType::Generic;
+  }
+  fmt::println("{} spheres and {} triangles packed, {} of {} leaves mixed",
+               packed.spheres.size(), packed.triangles.size(),
+               num_generic_leaves, num_leaves);
+
+  const HitComparison comparison =
+      compare_hits(scene.rays, closest_hit(generic), closest_hit(packed));
+  fmt::println("  {:<8} {:6.2f} Mrays/s", "virtual",
+               comparison.reference.mrays_per_second());
+  fmt::println("  {:<8} {:6.2f} Mrays/s", "packed",
+               comparison.candidate.mrays_per_second());
+  fmt::println("Packed leaves are {:.2f}x as fast; {} of {} closest hits "
+               "differ",
+               comparison.speedup(), comparison.num_mismatches,
+               scene.rays.size());
+}
+
+// Animates a field of num_spheres random spheres, each drifting with its own
+// velocity, and compares refitting one BVH every frame against rebuilding it.
+// A spatial split BVH over the same spheres is refit alongside, and must keep
+// finding the same closest hits as the rebuilt tree without ever holding more
+// references than its builder allows.
+void benchmark_refit(const size_t num_spheres) {
+  constexpr size_t num_frames = 16;
+  BenchmarkScene scene = benchmark_scene(num_spheres, 0, 1 << 14);
+  std::vector<vec3> velocities;
+  for (size_t i = 0; i < num_spheres; ++i)
+    velocities.push_back(scene.random.random_vec3(-0.25, 0.25));
+
+  BVHFlatTree bvh(scene.primitives);
+  BVHFlatTree sbvh{SpatialSplitBVH(scene.primitives)};
+  real refit_seconds = 0.0, rebuild_seconds = 0.0;
+  size_t num_rebuilds = 0, num_sbvh_rebuilds = 0, num_mismatches = 0;
+  size_t max_references = sbvh.primitives.size();
+  for (size_t frame = 1; frame <= num_frames; ++frame) {
+    for (size_t i = 0; i < num_spheres; ++i)
+      scene.spheres[i]->set_geometry(scene.spheres[i]->center + velocities[i],
+                                     scene.spheres[i]->radius);
+
+    const Timer refit_timer;
+    num_rebuilds += bvh.refit();
+    refit_seconds += refit_timer.elapsed_seconds();
+    num_sbvh_rebuilds += sbvh.refit();
+    max_references = std::max(max_references, sbvh.primitives.size());
+
+    const Timer rebuild_timer;
+    const BVHFlatTree rebuilt(scene.primitives);
+    rebuild_seconds += rebuild_timer.elapsed_seconds();
+    num_mismatches +=
+        compare_hits(scene.rays, closest_hit(rebuilt), closest_hit(sbvh))
+            .num_mismatches;
+    fmt::println("Frame {:2}: SAH cost {:.2f} refit, {:.2f} rebuilt, {:.2f} "
+                 "spatial split refit",
+                 frame, bvh.sah_cost(), rebuilt.sah_cost(), sbvh.sah_cost());
+  }
+  fmt::println("Refit {} frames in {:.3f} s ({} automatic rebuilds), rebuilt "
+               "them in {:.3f} s",
+               num_frames, refit_seconds, num_rebuilds, rebuild_seconds);
+  fmt::println("Spatial split BVH: {} automatic rebuilds, at most {:.2f} "
+               "references per sphere (limit {:.2f}), {} of {} closest hits "
+               "differ",
+               num_sbvh_rebuilds,
+               static_cast<real>(max_references) / num_spheres,
+               SpatialSplitBVH::default_max_duplication, num_mismatches,
+               num_frames * scene.rays.size());
+}
+
+// Builds a BVH over a field of num_spheres random spheres and snapshots it,
+// then loads the snapshot as a later run would and checks that rays hit the
+// same things in both trees
+void benchmark_snapshot(const size_t num_spheres) {
+  const std::string path = "output/benchmark.bvh";
+  const BenchmarkScene scene = benchmark_scene(num_spheres, 0, 1 << 18);
+  std::filesystem::remove(path);
+
+  const Timer build_timer;
+  const std::shared_ptr<BVHFlatTree> built =
+      load_or_build_bvh(scene.primitives, path);
+  const real build_seconds = build_timer.elapsed_seconds();
+  const Timer load_timer;
+  const std::shared_ptr<BVHFlatTree> loaded =
+      load_or_build_bvh(scene.primitives, path);
+  const real load_seconds = load_timer.elapsed_seconds();
+
+  const HitComparison comparison =
+      compare_hits(scene.rays, closest_hit(*built), closest_hit(*loaded));
+  fmt::println("Built and saved in {:.3f} s, loaded in {:.3f} s ({} bytes), "
+               "{} of {} hits differ",
+               build_seconds, load_seconds,
+               std::filesystem::file_size(path), comparison.num_mismatches,
+               scene.rays.size());
+}
+
+// A sphere of radius 1 around the origin, tessellated into triangles between
+// num_rings lines of latitude and twice as many lines of longitude
+std::vector<std::shared_ptr<Triangle>>
+sphere_mesh(const size_t num_rings, std::shared_ptr<Material> material) {
+  const size_t num_segments = 2 * num_rings;
+  const auto vertex = [&](const size_t ring, const size_t segment) {
+    const real theta = glm::pi<real>() * ring / num_rings;
+    const real phi = 2.0 * glm::pi<real>() * segment / num_segments;
+    return vec3(std::sin(theta) * std::cos(phi), std::cos(theta),
+                std::sin(theta) * std::sin(phi));
+  };
+
+  // The quads touching the poles lose a corner, so only get one triangle
+  std::vector<std::shared_ptr<Triangle>> triangles;
+  for (size_t ring = 0; ring < num_rings; ++ring) {
+    for (size_t segment = 0; segment < num_segments; ++segment) {
+      const vec3 a = vertex(ring, segment), b = vertex(ring + 1, segment);
+      const vec3 c = vertex(ring + 1, segment + 1),
+                 d = vertex(ring, segment + 1);
+      if (ring + 1 < num_rings)
+        triangles.push_back(std::make_shared<Triangle>(a, b, c, material));
+      if (ring > 0)
+        triangles.push_back(std::make_shared<Triangle>(a, c, d, material));
+    }
+  }
+  return triangles;
+}
+
+// Scatters num_instances randomly placed, rotated and scaled copies of one
+// sphere mesh, and compares a two-level hierarchy of Instances sharing one
+// bottom-level BVH against baking every copy's triangles into one BVHFlatTree
+void benchmark_instancing(const size_t num_instances) {
+  constexpr size_t num_rays = 1 << 18;
+  MersenneRNG random;
+  const auto material =
+      std::make_shared<Material>(DiffuseMaterial(Colour(0.5, 0.5, 0.5)));
+  const std::vector<std::shared_ptr<Triangle>> mesh = sphere_mesh(16, material);
+  const real half_size = 4.0 * std::cbrt(static_cast<real>(num_instances));
+  std::vector<mat4> transforms;
+  for (size_t i = 0; i < num_instances; ++i) {
+    mat4 transform = glm::translate(mat4(1.0),
+                                    random.random_vec3(-half_size, half_size));
+    transform = glm::rotate(transform,
+                            random.random_real(0.0, 2.0 * glm::pi<real>()),
+                            random.random_unit_vec3());
+    transforms.push_back(glm::scale(transform, random.random_vec3(0.5, 1.5)));
+  }
+
+  // Nodes, primitive pointers, packed copies and the primitives themselves
+  const auto bvh_bytes = [](const BVHFlatTree &bvh, const size_t num_objects,
+                            const size_t object_size) {
+    return bvh.nodes.size() * sizeof(BVHFlatTree::BVHNode) +
+           bvh.primitives.size() * sizeof(std::shared_ptr<Hittable>) +
+           bvh.spheres.size() * sizeof(PackedSphere) +
+           bvh.triangles.size() * sizeof(PackedTriangle) +
+           num_objects * object_size;
+  };
+
+  const Timer instanced_timer;
+  const auto bottom = std::make_shared<BVHFlatTree>(
+      std::vector<std::shared_ptr<Hittable>>(mesh.begin(), mesh.end()));
+  std::vector<std::shared_ptr<Hittable>> instances;
+  for (const mat4 &transform : transforms)
+    instances.push_back(std::make_shared<Instance>(bottom, transform));
+  const BVHFlatTree top(instances);
+  const real instanced_seconds = instanced_timer.elapsed_seconds();
+  const size_t instanced_bytes =
+      bvh_bytes(*bottom, mesh.size(), sizeof(Triangle)) +
+      bvh_bytes(top, instances.size(), sizeof(Instance));
+
+  const Timer baked_timer;
+  std::vector<std::shared_ptr<Hittable>> triangles;
+  for (const mat4 &transform : transforms) {
+    const auto to_world = [&](const vec3 &point) {
+      return vec3(transform * vec4(point, 1.0));
+    };
+    for (const auto &triangle : mesh)
+      triangles.push_back(std::make_shared<Triangle>(
+          to_world(triangle->a), to_world(triangle->b), to_world(triangle->c),
+          material));
+  }
+  const BVHFlatTree baked(triangles);
+  const real baked_seconds = baked_timer.elapsed_seconds();
+  const size_t baked_bytes =
+      bvh_bytes(baked, triangles.size(), sizeof(Triangle));
+
+  const std::vector<Ray> rays = random_rays(num_rays, half_size, random);
+  // Transforming rays rather than triangles rounds differently
+  const HitComparison comparison =
+      compare_hits(rays, closest_hit(baked), closest_hit(top), 1e-6);
+
+  fmt::println("{} instances of a {}-triangle mesh:", num_instances,
+               mesh.size());
+  fmt::println("  instanced  build {:7.3f} s, {:8.1f} MiB, {:6.2f} Mrays/s",
+               instanced_seconds, instanced_bytes / 1048576.0,
+               comparison.candidate.mrays_per_second());
+  fmt::println("  baked      build {:7.3f} s, {:8.1f} MiB, {:6.2f} Mrays/s",
+               baked_seconds, baked_bytes / 1048576.0,
+               comparison.reference.mrays_per_second());
+  fmt::println("  {} of {} closest hits differ", comparison.num_mismatches,
+               rays.size());
+}
+
+// Renders a field of num_spheres spheres whose materials cycle through every
+// shading queue the wavefront integrator sorts by, once with the reference
+// integrator and once with the wavefront one, and compares their speed and
+// images. Solid-coloured spheres each get a material of their own; the
+// image-textured ones share two, since every Texture copies its image.
+void benchmark_wavefront(const size_t num_spheres) {
+  constexpr size_t samples_per_pixel = 16;
+  constexpr size_t max_depth = 50;
+  MersenneRNG random;
+  const Texture earth_texture = ImageTexture("res/earthmap.jpg");
+  const auto earth_diffuse =
+      std::make_shared<Material>(DiffuseMaterial(earth_texture));
+  const auto earth_reflective =
+      std::make_shared<Material>(ReflectiveMaterial(earth_texture, 0.2));
+  const auto ground_material =
+      std::make_shared<Material>(DiffuseMaterial(Colour(0.5, 0.5, 0.5)));
+  std::vector<std::shared_ptr<Hittable>> objects{
+      std::make_shared<Sphere>(vec3(0, -1000, 0), 1000, ground_material)};
+  const real half_size = std::sqrt(static_cast<real>(num_spheres));
+  for (size_t i = 0; i < num_spheres; ++i) {
+    const Colour albedo = random.random_vec3(0.2, 1.0);
+    std::shared_ptr<Material> material;
+    switch (i % 5) {
+    case 0:
+      material = std::make_shared<Material>(DiffuseMaterial(albedo));
+      break;
+    case 1:
+      material = earth_diffuse;
+      break;
+    case 2:
+      material = std::make_shared<Material>(
+          ReflectiveMaterial(albedo, random.random_real(0.0, 0.5)));
+      break;
+    case 3:
+      material = earth_reflective;
+      break;
+    default:
+      material = std::make_shared<Material>(
+          DielectricMaterial(albedo, random.random_real(1.3, 1.8)));
+      break;
+    }
+    const vec3 center(random.random_real(-half_size, half_size), 0.3,
+                      random.random_real(-half_size, half_size));
+    objects.push_back(std::make_shared<Sphere>(center, 0.3, material));
+  }
   Scene scene;
-  scene.add(random_scene());
-  scene.render(camera, image, 100, 100);
+  scene.add(std::make_shared<BVHFlatTree>(objects));
+
+  Camera camera(vec3(0.0, half_size, 2.0 * half_size), vec3(0.0, 0.0, 0.0));
+  camera.vertical_fov = 40;
+  const auto run = [&](const Integrator integrator) {
+    RGBImage image(400, 300);
+    camera.set_output_image(image);
+    RenderSettings settings;
+    settings.integrator = integrator;
+    const Timer timer;
+    scene.just_render(camera, image, samples_per_pixel, max_depth, settings);
+    return std::make_pair(timer.elapsed_seconds(), image);
+  };
+  const auto [reference_seconds, reference_image] = run(Integrator::Reference);
+  const auto [wavefront_seconds, wavefront_image] = run(Integrator::Wavefront);
+
+  size_t num_mismatches = 0;
+  for (size_t i = 0; i < reference_image.m_pixels.size(); ++i)
+    num_mismatches += reference_image.m_pixels[i].to_pixel() !=
+                      wavefront_image.m_pixels[i].to_pixel();
+
+  fmt::println("{} spheres across every shading queue, {} spp:", num_spheres,
+               samples_per_pixel);
+  fmt::println("  reference  {:7.3f} s", reference_seconds);
+  fmt::println("  wavefront  {:7.3f} s ({:.2f}x)", wavefront_seconds,
+               reference_seconds / wavefront_seconds);
+  fmt::println("  {} of {} pixels differ", num_mismatches,
+               reference_image.m_pixels.size());
+}
+
+template <typename Pixel>
+void merge_shards(const std::string &output,
+                  const std::vector<std::string> &shards,
+                  const CheckpointInfo &info) {
+  OutputImage<Pixel> image(info.width, info.height);
+  std::vector<MergedCheckpoint> merged;
+  for (const std::string &shard : shards) {
+    try {
+      if (merge_checkpoint(shard, image, merged))
+        continue;
+      fmt::println("Skipping shard '{}': could not open it", shard);
+    } catch (const std::exception &e) {
+      fmt::println("Skipping shard '{}': {}", shard, e.what());
+    }
+  }
+  fmt::println("Merged {} of {} shards into '{}'", merged.size(),
+               shards.size(), output);
+  image.write_png(output);
+}
+
+// Combines the accumulators of every readable shard checkpoint, weighting
+// each pixel by its sample count. Missing or corrupt shards are skipped, as
+// are shards whose seed, tile size or sample range don't fit the ones merged
+// before them.
+int merge_shards(const std::string &output,
+                 const std::vector<std::string> &shards) {
+  for (const std::string &shard : shards) {
+    std::optional<CheckpointInfo> info;
+    try {
+      info = peek_checkpoint_info(shard);
+    } catch (const std::exception &) {
+    }
+    if (!info.has_value())
+      continue;
+
+    switch (info->pixel_type) {
+    case RGBPixel::type_id:
+      merge_shards<RGBPixel>(output, shards, *info);
+      return 0;
+    case RGBVariancePixel::type_id:
+      merge_shards<RGBVariancePixel>(output, shards, *info);
+      return 0;
+    case SpectralPixel::type_id:
+      merge_shards<SpectralPixel>(output, shards, *info);
+      return 0;
+    }
+  }
+  fmt::println("None of the shards could be read");
+  return 1;
+}
+
+// Parses a positive count given on the command line, such as a benchmark's
+// problem size, reporting what it should have been if it isn't one
+std::optional<size_t> parse_count(const std::string &text, const char *what) {
+  size_t count = 0;
+  char trailing;
+  if (std::sscanf(text.c_str(), "%zu%c", &count, &trailing) != 1 ||
+      count == 0) {
+    fmt::println("Expected a positive {}, got '{}'", what, text);
+    return std::nullopt;
+  }
+  return count;
 }
 
-int main() { render_spectral(); }
+// A benchmark subcommand, and the problem size it runs at unless given one.
+// Benchmarks without a count_name take no size.
+struct Benchmark {
+  std::string_view name;
+  const char *count_name;
+  size_t default_count;
+  void (*run)(size_t count);
+};
+
+const std::array<Benchmark, 10> benchmarks = {{
+    {"traversal", nullptr, 0, [](size_t) { benchmark_traversal(); }},
+    {"occlusion", nullptr, 0, [](size_t) { benchmark_occlusion(); }},
+    {"builders", "num_spheres", 1 << 20, benchmark_builders},
+    {"refit", "num_spheres", 1 << 20, benchmark_refit},
+    {"snapshot", "num_spheres", 1 << 20, benchmark_snapshot},
+    {"layout", "num_spheres", 1 << 20, benchmark_layout},
+    {"instancing", "num_instances", 1000, benchmark_instancing},
+    {"sbvh", "num_triangles", 1 << 18, benchmark_sbvh},
+    {"packing", "num_primitives", 1 << 20, benchmark_packing},
+    {"wavefront", "num_spheres", 1000, benchmark_wavefront},
+}};
+
+int main(int argc, char *argv[]) {
+  const std::vector<std::string_view> args(argv + 1, argv + argc);
+  const auto usage = [&]() {
+    fmt::println("Usage: {} [render [--resume] [--shard <k>/<n>] "
+                 "[--adaptive] [--time-budget <seconds>] [--packets] "
+                 "[--wavefront] [--bvh sah|sbvh]]",
+                 argv[0]);
+    fmt::println("       {} merge <output.png> <shard checkpoint>...",
+                 argv[0]);
+    fmt::println("       {} coordinate <address> [--scene <name>]", argv[0]);
+    fmt::println("       {} work <address> [--threads <n>] "
+                 "[--snapshot-dir <dir>] [--bvh sah|sbvh]",
+                 argv[0]);
+    fmt::println("       {} stats [--json <path>]", argv[0]);
+    for (const Benchmark &benchmark : benchmarks) {
+      if (benchmark.count_name == nullptr)
+        fmt::println("       {} benchmark {}", argv[0], benchmark.name);
+      else
+        fmt::println("       {} benchmark {} [{}]", argv[0], benchmark.name,
+                     benchmark.count_name);
+    }
+    fmt::println("Addresses are host:port, or unix:<path> for local sockets");
+    return 1;
+  };
+  const auto parse_builder = [](const std::string_view name,
+                                BVHBuilder &builder) {
+    if (name == "sah")
+      builder = BVHBuilder::SAH;
+    else if (name == "sbvh")
+      builder = BVHBuilder::SpatialSplit;
+    else
+      return false;
+    return true;
+  };
+
+  if (args.empty()) {
+    render_spectral();
+  } else if (args[0] == "render") {
+    RenderOptions options;
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (args[i] == "--resume") {
+        options.resume = true;
+      } else if (args[i] == "--packets") {
+        options.ray_packets = true;
+      } else if (args[i] == "--adaptive") {
+        options.adaptive = true;
+      } else if (args[i] == "--wavefront") {
+        options.wavefront = true;
+      } else if (args[i] == "--time-budget" && i + 1 < args.size()) {
+        const std::string seconds(args[++i]);
+        double time_budget_seconds = 0.0;
+        if (std::sscanf(seconds.c_str(), "%lf", &time_budget_seconds) != 1 ||
+            !(time_budget_seconds > 0.0))
+          return usage();
+        options.time_budget_seconds = time_budget_seconds;
+      } else if (args[i] == "--bvh" && i + 1 < args.size()) {
+        if (!parse_builder(args[++i], options.builder))
+          return usage();
+      } else if (args[i] == "--shard" && i + 1 < args.size()) {
+        const std::string spec(args[++i]);
+        if (std::sscanf(spec.c_str(), "%zu/%zu", &options.shard,
+                        &options.num_shards) != 2 ||
+            options.shard >= options.num_shards)
+          return usage();
+      } else {
+        return usage();
+      }
+    }
+    // Adaptive and timed renders are neither checkpointed nor sharded, and
+    // spend their budgets differently
+    const bool budgeted = options.time_budget_seconds > 0.0;
+    if ((options.adaptive || budgeted) &&
+        (options.resume || options.num_shards > 1))
+      return usage();
+    if (options.adaptive && budgeted)
+      return usage();
+    render(options);
+  } else if (args[0] == "merge" && args.size() >= 3) {
+    return merge_shards(std::string(args[1]),
+                        std::vector<std::string>(args.begin() + 2, args.end()));
+  } else if (args[0] == "coordinate" && args.size() >= 2) {
+    std::string scene_name = "random";
+    for (size_t i = 2; i < args.size(); ++i) {
+      if (args[i] == "--scene" && i + 1 < args.size())
+        scene_name = args[++i];
+      else
+        return usage();
+    }
+    return coordinate(std::string(args[1]), scene_name);
+  } else if (args[0] == "work" && args.size() >= 2) {
+    size_t num_threads = default_num_threads();
+    std::string snapshot_dir;
+    BVHBuilder builder = BVHBuilder::SAH;
+    for (size_t i = 2; i < args.size(); ++i) {
+      const std::string arg(args[i]);
+      if (arg == "--threads" && i + 1 < args.size()) {
+        const std::optional<size_t> count =
+            parse_count(std::string(args[++i]), "thread count");
+        if (!count.has_value())
+          return usage();
+        num_threads = *count;
+      } else if (arg == "--snapshot-dir" && i + 1 < args.size()) {
+        snapshot_dir = args[++i];
+      } else if (arg == "--bvh" && i + 1 < args.size()) {
+        if (!parse_builder(args[++i], builder))
+          return usage();
+      } else {
+        return usage();
+      }
+    }
+    install_interrupt_handlers();
+    try {
+      run_worker(std::string(args[1]), scene_registry(snapshot_dir, builder),
+                 num_threads);
+    } catch (const std::exception &e) {
+      fmt::println("Worker failed: {}", e.what());
+      return 1;
+    }
+  } else if (args[0] == "stats") {
+    std::string json_path;
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (args[i] == "--json" && i + 1 < args.size())
+        json_path = args[++i];
+      else
+        return usage();
+    }
+    report_stats(json_path);
+  } else if (args[0] == "benchmark" && args.size() >= 2 && args.size() <= 3) {
+    const auto benchmark = std::find_if(
+        benchmarks.begin(), benchmarks.end(),
+        [&](const Benchmark &benchmark) { return benchmark.name == args[1]; });
+    if (benchmark == benchmarks.end() ||
+        (args.size() == 3 && benchmark->count_name == nullptr))
+      return usage();
+    size_t count = benchmark->default_count;
+    if (args.size() == 3) {
+      const std::optional<size_t> parsed =
+          parse_count(std::string(args[2]), benchmark->count_name);
+      if (!parsed.has_value())
+        return usage();
+      count = *parsed;
+    }
+    benchmark->run(count);
+  } else {
+    return usage();
+  }
+}
@@ -5,9 +5,10 @@
 
 real schlick_reflection_probability(const real cos_theta,
                                     const real ior_ratio) {
-  const real r0 = (1.0 - ior_ratio) / (1.0 + ior_ratio);
+  const real r0 = (real(1.0) - ior_ratio) / (real(1.0) + ior_ratio);
   const real r0_squared = r0 * r0;
-  return r0_squared + (1.0 - r0_squared) * std::pow(1.0 - cos_theta, 5.0);
+  return r0_squared +
+         (real(1.0) - r0_squared) * std::pow(real(1.0) - cos_theta, real(5.0));
 }
 
 bool DielectricMaterial::scatter(RNG &random, const Ray &ray,
@@ -17,7 +18,7 @@ bool DielectricMaterial::scatter(RNG &random, const Ray &ray,
   attenuation = albedo.value(record.uv, record.pos);
 
   const real ior_ratio =
-      record.front_face ? (1.0 / refractive_index) : refractive_index;
+      record.front_face ? (real(1.0) / refractive_index) : refractive_index;
   const real cos_theta = glm::dot(-ray.direction, record.normal);
   const real sin_theta = std::sqrt<real>(1.0 - cos_theta * cos_theta);
   const bool should_reflect =
@@ -82,4 +82,11 @@ struct Material {
         [&ray](const auto &material) { return material.get_ior(ray); },
         material);
   }
+
+  // Perfect mirrors keep neighbouring rays together, so packets can keep
+  // tracing them as a group
+  bool is_perfect_mirror() const {
+    const auto *reflective = std::get_if<ReflectiveMaterial>(&material);
+    return reflective != nullptr && reflective->fuzz == 0.0;
+  }
 };
@@ -2,8 +2,10 @@
 #pragma once
 
 #include "util/ray.hpp"
+#include "util/ray_packet.hpp"
 #include "util/util.hpp"
 
+#include <array>
 #include <cmath>
 #include <iostream>
 #include <optional>
@@ -17,7 +19,7 @@ struct BoundingBox {
 
   constexpr inline real surface_area() const {
     const vec3 d = max - min;
-    return 2.0 * (d.x * d.y + d.x * d.z + d.y * d.z);
+    return real(2.0) * (d.x * d.y + d.x * d.z + d.y * d.z);
   }
 
   constexpr inline real volume() const {
@@ -68,7 +70,100 @@ struct BoundingBox {
                                 : std::nullopt;
   }
 
+  // Slab test for a ray with precomputed inverse direction. Returns where the
+  // ray enters the box, or INFINITY if it misses it within [t_min, t_max].
+  __attribute((hot)) constexpr inline real
+  hit_distance(const PrecomputedRay &ray, const real t_min,
+               const real t_max) const {
+    const vec3 t1 = (min - ray.origin) * ray.inv_direction;
+    const vec3 t2 = (max - ray.origin) * ray.inv_direction;
+    const real t_near = std::max(t_min, glm::compMax(glm::min(t1, t2)));
+    const real t_far = std::min(t_max, glm::compMin(glm::max(t1, t2)));
+    return t_near < t_far ? t_near : INFINITY;
+  }
+
+  // Slab test against every lane of a packet at once. Returns the lanes of
+  // mask whose ray overlaps the box somewhere in [t_min, t_max[lane]].
+  template <size_t N>
+  __attribute((hot)) inline uint32_t
+  hit_packet(const RayPacket<N> &packet, const real t_min,
+             const std::array<real, N> &t_max, const uint32_t mask) const {
+    std::array<real, N> t_near, t_far;
+    for (size_t lane = 0; lane < N; ++lane) {
+      t_near[lane] = t_min;
+      t_far[lane] = t_max[lane];
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+      for (size_t lane = 0; lane < N; ++lane) {
+        const real origin = packet.origins[axis][lane];
+        const real inv_direction = packet.inv_directions[axis][lane];
+        const real t1 = (min[axis] - origin) * inv_direction;
+        const real t2 = (max[axis] - origin) * inv_direction;
+        t_near[lane] = std::max(t_near[lane], std::min(t1, t2));
+        t_far[lane] = std::min(t_far[lane], std::max(t1, t2));
+      }
+    }
+
+    uint32_t result = 0;
+    for (size_t lane = 0; lane < N; ++lane)
+      result |= static_cast<uint32_t>(t_near[lane] < t_far[lane]) << lane;
+    return result & mask;
+  }
+
   friend std::ostream &operator<<(std::ostream &os, const BoundingBox &box) {
     return os << glm::to_string(box.min) << " - " << glm::to_string(box.max);
   }
 };
+
+// A BoundingBox stored in single precision, for BVH nodes: half the size, so
+// twice as many nodes fit in each cache line. The bounds are rounded outwards,
+// so the compact box always contains the box it was made from and traversal
+// never misses a primitive. Slab tests widen it back to `real` first.
+struct CompactBoundingBox {
+  std::array<float, 3> min, max;
+
+  CompactBoundingBox() : CompactBoundingBox(BoundingBox()) {}
+  CompactBoundingBox(const BoundingBox &box) {
+    for (int axis = 0; axis < 3; ++axis) {
+      min[axis] = round_down(box.min[axis]);
+      max[axis] = round_up(box.max[axis]);
+    }
+  }
+
+  constexpr inline operator BoundingBox() const {
+    return BoundingBox(vec3(min[0], min[1], min[2]),
+                       vec3(max[0], max[1], max[2]));
+  }
+
+  constexpr inline real surface_area() const {
+    return BoundingBox(*this).surface_area();
+  }
+
+  __attribute((hot)) constexpr std::optional<std::pair<real, real>>
+  hit_interval(const Ray &ray, const real t_min, const real t_max) const {
+    return BoundingBox(*this).hit_interval(ray, t_min, t_max);
+  }
+
+  __attribute((hot)) constexpr inline real
+  hit_distance(const PrecomputedRay &ray, const real t_min,
+               const real t_max) const {
+    return BoundingBox(*this).hit_distance(ray, t_min, t_max);
+  }
+
+  template <size_t N>
+  __attribute((hot)) inline uint32_t
+  hit_packet(const RayPacket<N> &packet, const real t_min,
+             const std::array<real, N> &t_max, const uint32_t mask) const {
+    return BoundingBox(*this).hit_packet(packet, t_min, t_max, mask);
+  }
+
+private:
+  static inline float round_down(const real value) {
+    const float result = static_cast<float>(value);
+    return result > value ? std::nextafter(result, -INFINITY) : result;
+  }
+  static inline float round_up(const real value) {
+    const float result = static_cast<float>(value);
+    return result < value ? std::nextafter(result, INFINITY) : result;
+  }
+};
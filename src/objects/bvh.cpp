@@ -3,33 +3,114 @@
 
 #include "objects/hit_record.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <deque>
 #include <iostream>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <typeinfo>
+
+// The SAH cost of splitting a node with surface area bounds_area, relative to
+// the cost of intersecting one primitive
+static inline real split_cost(const real left_count, const real left_area,
+                              const real right_count, const real right_area,
+                              const real bounds_area) {
+  return BVHTree::node_traversal_cost +
+         (left_count * left_area + right_count * right_area) / bounds_area;
+}
+
+// How many threads to spread a pass over num_primitives primitives across
+static inline size_t num_chunks(const size_t num_primitives,
+                                const size_t num_threads) {
+  return std::clamp<size_t>(
+      num_primitives / BVHTree::min_parallel_primitives, 1, num_threads);
+}
+
+BVHTree::BVHTree(const std::vector<std::shared_ptr<Hittable>> &primitives,
+                 const size_t num_threads)
+    : primitives(primitives), build_primitives(primitives.size()) {
+  for_each_chunk(0, primitives.size(),
+                 num_chunks(primitives.size(), num_threads),
+                 [&](const size_t, const size_t chunk_start,
+                     const size_t chunk_end) {
+                   for (size_t i = chunk_start; i < chunk_end; ++i) {
+                     const BoundingBox box = primitives[i]->bounding_box();
+                     build_primitives[i] = {box,
+                                            real(0.5) * (box.min + box.max),
+                                            static_cast<uint32_t>(i)};
+                   }
+                 });
+  root = construct(0, primitives.size(), num_threads);
+}
 
 std::optional<std::pair<int, size_t>>
-BVHTree::split_and_partition(const size_t start_idx, const size_t end_idx) {
+BVHTree::split_and_partition(const size_t start_idx, const size_t end_idx,
+                             const size_t num_threads) {
+  const size_t num_primitives = end_idx - start_idx;
+  const size_t chunks = num_chunks(num_primitives, num_threads);
+  std::vector<BoundingBox> chunk_bounds(chunks), chunk_centroid_bounds(chunks);
+  for_each_chunk(start_idx, end_idx, chunks,
+                 [&](const size_t chunk, const size_t chunk_start,
+                     const size_t chunk_end) {
+                   for (size_t i = chunk_start; i < chunk_end; ++i) {
+                     const BuildPrimitive &primitive = build_primitives[i];
+                     chunk_bounds[chunk].union_with(primitive.box);
+                     chunk_centroid_bounds[chunk].union_with(
+                         BoundingBox(primitive.centroid, primitive.centroid));
+                   }
+                 });
+  BoundingBox bounds, centroid_bounds;
+  for (size_t chunk = 0; chunk < chunks; ++chunk) {
+    bounds.union_with(chunk_bounds[chunk]);
+    centroid_bounds.union_with(chunk_centroid_bounds[chunk]);
+  }
+
+  // Binning needs centroids spread along some axis
+  std::optional<Split> split;
+  if (num_primitives > max_exact_sweep_primitives)
+    split = binned_split(start_idx, end_idx, bounds, centroid_bounds,
+                         num_threads);
+  if (!split.has_value())
+    split = sweep_split(start_idx, end_idx, bounds);
+
+  const real leaf_cost = num_primitives;
+  const size_t max_primitives = (1 << 16) - 1;
+  const bool make_leaf =
+      leaf_cost < split->cost && num_primitives <= max_primitives;
+  return make_leaf ? std::nullopt
+                   : std::make_optional(std::make_pair(split->axis,
+                                                       split->mid_idx));
+}
+
+BVHTree::Split BVHTree::sweep_split(const size_t start_idx,
+                                    const size_t end_idx,
+                                    const BoundingBox &bounds) {
+  const auto begin = build_primitives.begin() + start_idx;
+  const auto end = build_primitives.begin() + end_idx;
   const int num_primitives = end_idx - start_idx;
-  std::pair<int, int> best_split = {0, start_idx + 1};
-  real best_cost = INFINITY;
+  const real bounds_surface_area = bounds.surface_area();
+  Split best_split = {0, start_idx + 1, INFINITY};
 
+  std::vector<real> prefix_sah(num_primitives);
+  std::vector<real> suffix_sah(num_primitives);
   for (int axis = 0; axis < 3; ++axis) {
     // 1. Sort along this axis
-    std::sort(primitives.begin() + start_idx, primitives.begin() + end_idx,
-              [axis](const std::shared_ptr<Hittable> &a,
-                     const std::shared_ptr<Hittable> &b) {
-                return a->bounding_box().min[axis] <
-                       b->bounding_box().min[axis];
+    std::sort(begin, end,
+              [axis](const BuildPrimitive &a, const BuildPrimitive &b) {
+                return a.box.min[axis] < b.box.min[axis];
               });
 
     // 2. For every split, compute the bounding boxes of the two partitions
-    std::vector<real> prefix_sah(num_primitives);
-    std::vector<real> suffix_sah(num_primitives);
 
     // prefix_sah[i] is the surface area of the bounding box for the first i
     // primitives
     BoundingBox prefix_box;
     for (int i = 0; i < num_primitives; ++i) {
       prefix_sah[i] = prefix_box.surface_area();
-      prefix_box.union_with(primitives[start_idx + i]->bounding_box());
+      prefix_box.union_with(build_primitives[start_idx + i].box);
     }
 
     // suffix_box[i] is the surface area of the bounding box for the last
@@ -37,107 +118,438 @@ BVHTree::split_and_partition(const size_t start_idx, const size_t end_idx) {
     BoundingBox suffix_box;
     for (int i = num_primitives - 1; i >= 0; --i) {
       suffix_sah[i] = suffix_box.surface_area();
-      suffix_box.union_with(primitives[start_idx + i]->bounding_box());
+      suffix_box.union_with(build_primitives[start_idx + i].box);
     }
 
-    const real bounds_surface_area = prefix_box.surface_area();
     for (int i = 1; i < num_primitives - 1; ++i) {
-      const real left_count = i, right_count = num_primitives - i;
       const real cost =
-          0.125 + (left_count * prefix_sah[i] + right_count * suffix_sah[i]) /
-                      bounds_surface_area;
+          split_cost(i, prefix_sah[i], num_primitives - i, suffix_sah[i],
+                     bounds_surface_area);
+      if (cost < best_split.cost)
+        best_split = {axis, start_idx + i, cost};
+    }
+  }
 
-      if (cost < best_cost) {
-        best_split = {axis, start_idx + i};
-        best_cost = cost;
+  const int best_axis = best_split.axis;
+  std::sort(begin, end,
+            [best_axis](const BuildPrimitive &a, const BuildPrimitive &b) {
+              return a.box.min[best_axis] < b.box.min[best_axis];
+            });
+  return best_split;
+}
+
+std::optional<BVHTree::Split>
+BVHTree::binned_split(const size_t start_idx, const size_t end_idx,
+                      const BoundingBox &bounds,
+                      const BoundingBox &centroid_bounds,
+                      const size_t num_threads) {
+  struct Bin {
+    BoundingBox box;
+    size_t count = 0;
+  };
+  using AxisBins = std::array<std::array<Bin, num_bins>, 3>;
+
+  const vec3 extent = centroid_bounds.max - centroid_bounds.min;
+  const vec3 scale = static_cast<real>(num_bins) / extent;
+  const auto bin_index = [&](const vec3 &centroid, const int axis) {
+    const size_t bin = static_cast<size_t>(
+        (centroid[axis] - centroid_bounds.min[axis]) * scale[axis]);
+    return std::min(bin, num_bins - 1);
+  };
+
+  // Every chunk of primitives is binned separately, then the bins are summed;
+  // box unions and counts are exact, so the result doesn't depend on chunking
+  const size_t chunks = num_chunks(end_idx - start_idx, num_threads);
+  std::vector<AxisBins> chunk_bins(chunks);
+  for_each_chunk(start_idx, end_idx, chunks,
+                 [&](const size_t chunk, const size_t chunk_start,
+                     const size_t chunk_end) {
+                   AxisBins &bins = chunk_bins[chunk];
+                   for (size_t i = chunk_start; i < chunk_end; ++i) {
+                     const BuildPrimitive &primitive = build_primitives[i];
+                     for (int axis = 0; axis < 3; ++axis) {
+                       if (!(extent[axis] > 0.0))
+                         continue;
+                       Bin &bin = bins[axis][bin_index(primitive.centroid,
+                                                       axis)];
+                       bin.box.union_with(primitive.box);
+                       ++bin.count;
+                     }
+                   }
+                 });
+  for (size_t chunk = 1; chunk < chunks; ++chunk) {
+    for (int axis = 0; axis < 3; ++axis) {
+      for (size_t b = 0; b < num_bins; ++b) {
+        chunk_bins[0][axis][b].box.union_with(chunk_bins[chunk][axis][b].box);
+        chunk_bins[0][axis][b].count += chunk_bins[chunk][axis][b].count;
       }
     }
   }
 
-  const int best_axis = best_split.first;
-  std::sort(primitives.begin() + start_idx, primitives.begin() + end_idx,
-            [best_axis](const std::shared_ptr<Hittable> &a,
-                        const std::shared_ptr<Hittable> &b) {
-              return a->bounding_box().min[best_axis] <
-                     b->bounding_box().min[best_axis];
-            });
+  const real bounds_surface_area = bounds.surface_area();
+  std::optional<Split> best_split;
+  size_t best_bin = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!(extent[axis] > 0.0))
+      continue;
+    const std::array<Bin, num_bins> &bins = chunk_bins[0][axis];
 
-  const real leaf_cost = num_primitives;
-  const int max_primitives = (1 << 16) - 1;
-  const bool make_leaf =
-      leaf_cost < best_cost && num_primitives <= max_primitives;
-  return make_leaf ? std::nullopt : std::make_optional(best_split);
+    // suffix_sah[b] and suffix_count[b] describe bins [b, num_bins)
+    std::array<real, num_bins> suffix_sah;
+    std::array<size_t, num_bins> suffix_count;
+    BoundingBox suffix_box;
+    size_t count = 0;
+    for (size_t b = num_bins - 1; b > 0; --b) {
+      suffix_box.union_with(bins[b].box);
+      count += bins[b].count;
+      suffix_sah[b] = suffix_box.surface_area();
+      suffix_count[b] = count;
+    }
+
+    // Splitting before bin b puts bins [0, b) on the left
+    BoundingBox prefix_box;
+    count = 0;
+    for (size_t b = 1; b < num_bins; ++b) {
+      prefix_box.union_with(bins[b - 1].box);
+      count += bins[b - 1].count;
+      if (count == 0 || suffix_count[b] == 0)
+        continue;
+      const real cost =
+          split_cost(count, prefix_box.surface_area(), suffix_count[b],
+                     suffix_sah[b], bounds_surface_area);
+      if (!best_split.has_value() || cost < best_split->cost) {
+        best_split = Split{axis, start_idx + count, cost};
+        best_bin = b;
+      }
+    }
+  }
+
+  if (best_split.has_value()) {
+    const int axis = best_split->axis;
+    std::partition(build_primitives.begin() + start_idx,
+                   build_primitives.begin() + end_idx,
+                   [&](const BuildPrimitive &primitive) {
+                     return bin_index(primitive.centroid, axis) < best_bin;
+                   });
+  }
+  return best_split;
 }
 
-std::shared_ptr<BVHTree::BVHTreeNode> BVHTree::construct(const size_t start_idx,
-                                                         const size_t end_idx) {
+std::shared_ptr<BVHTree::BVHTreeNode>
+BVHTree::construct(const size_t start_idx, const size_t end_idx,
+                   const size_t num_threads) {
   const std::optional<std::pair<int, size_t>> mid =
-      split_and_partition(start_idx, end_idx);
+      split_and_partition(start_idx, end_idx, num_threads);
   if (!mid.has_value()) {
     BoundingBox box;
     std::vector<std::shared_ptr<Hittable>> primitives;
     for (size_t i = start_idx; i < end_idx; ++i) {
-      primitives.push_back(this->primitives[i]);
-      box.union_with(this->primitives[i]->bounding_box());
+      primitives.push_back(this->primitives[build_primitives[i].index]);
+      box.union_with(build_primitives[i].box);
     }
     return std::make_shared<BVHTreeNode>(primitives, box);
+  }
+
+  // The two halves are disjoint ranges of build_primitives, so they can be
+  // built concurrently, sharing out the threads
+  const auto &[mid_axis, mid_idx] = mid.value();
+  std::shared_ptr<BVHTreeNode> left, right;
+  if (num_threads > 1 && end_idx - start_idx >= min_parallel_primitives) {
+    const size_t left_threads = num_threads / 2;
+    std::thread left_thread(
+        [&]() { left = construct(start_idx, mid_idx, left_threads); });
+    right = construct(mid_idx, end_idx, num_threads - left_threads);
+    left_thread.join();
   } else {
-    const auto &[mid_axis, mid_idx] = mid.value();
-    const std::shared_ptr<BVHTreeNode> left = construct(start_idx, mid_idx);
-    const std::shared_ptr<BVHTreeNode> right = construct(mid_idx, end_idx);
-    return std::make_shared<BVHTreeNode>(left, right, mid_axis);
+    left = construct(start_idx, mid_idx);
+    right = construct(mid_idx, end_idx);
   }
+  return std::make_shared<BVHTreeNode>(left, right, mid_axis);
 }
 
-size_t BVHFlatTree::construct(std::shared_ptr<BVHTree::BVHTreeNode> node) {
-  const size_t node_idx = nodes.size();
-  nodes.emplace_back(node->box, 3, 0, 0);
-
+void BVHFlatTree::construct(const std::shared_ptr<BVHTree::BVHTreeNode> &node,
+                            const size_t node_idx, const size_t descendants_idx,
+                            const size_t primitive_idx,
+                            const size_t num_threads) {
   if (node->primitives.size() > 0) {
-    const uint32_t primitive_index = primitives.size();
     const uint16_t num_primitives = node->primitives.size();
-    for (const auto &primitive : node->primitives)
-      primitives.push_back(primitive);
+    std::copy(node->primitives.begin(), node->primitives.end(),
+              primitives.begin() + primitive_idx);
+    nodes[node_idx] = BVHNode(node->box, 3, primitive_idx, num_primitives);
+    return;
+  }
+
+  // The children's pair, then the left child's descendants, then the right's
+  const size_t left_idx = descendants_idx, right_idx = descendants_idx + 1;
+  const size_t left_descendants_idx = descendants_idx + 2;
+  const size_t right_descendants_idx =
+      left_descendants_idx + node->left->subtree_nodes - 1;
+  const size_t right_primitive_idx =
+      primitive_idx + node->left->subtree_primitives;
+  nodes[node_idx] = BVHNode(node->box, node->axis, left_idx, 0);
 
-    nodes[node_idx] = BVHNode(node->box, 3, primitive_index, num_primitives);
-    return node_idx;
+  if (num_threads > 1 &&
+      node->subtree_primitives >= BVHTree::min_parallel_primitives) {
+    const size_t left_threads = num_threads / 2;
+    std::thread left_thread([&]() {
+      construct(node->left, left_idx, left_descendants_idx, primitive_idx,
+                left_threads);
+    });
+    construct(node->right, right_idx, right_descendants_idx,
+              right_primitive_idx, num_threads - left_threads);
+    left_thread.join();
   } else {
-    const uint32_t left_index = construct(node->left);
-    debug_assert_eq(left_index, node_idx + 1, "Invariant broken");
-    const uint32_t right_index = construct(node->right);
-    nodes[node_idx] = BVHNode(node->box, node->axis, right_index, 0);
-    return node_idx;
+    construct(node->left, left_idx, left_descendants_idx, primitive_idx);
+    construct(node->right, right_idx, right_descendants_idx,
+              right_primitive_idx);
+  }
+}
+
+size_t BVHFlatTree::compute_depth(const size_t node_idx) const {
+  const BVHNode &node = nodes[node_idx];
+  if (node.is_leaf())
+    return 1;
+  return 1 + std::max(compute_depth(node.child_index),
+                      compute_depth(node.child_index + 1));
+}
+
+void BVHFlatTree::pack_primitives() {
+  // Only exact types are packed: a subclass may intersect differently
+  const auto leaf_type = [&](const BVHNode &leaf) {
+    bool all_spheres = true, all_triangles = true;
+    for (size_t i = 0; i < leaf.num_primitives; ++i) {
+      const Hittable &primitive = *primitives[leaf.primitive_index + i];
+      all_spheres &= typeid(primitive) == typeid(Sphere);
+      all_triangles &= typeid(primitive) == typeid(Triangle);
+    }
+    return all_spheres     ? LeafType::Sphere
+           : all_triangles ? LeafType::Triangle
+                           : LeafType::Generic;
+  };
+  for (BVHNode &node : nodes)
+    if (node.is_leaf())
+      node.leaf_type = leaf_type(node);
+
+  // Leaves keep their order within each range, so the packed copies are laid
+  // out in roughly the order traversal reaches them
+  std::vector<std::shared_ptr<Hittable>> grouped;
+  grouped.reserve(primitives.size());
+  spheres.clear();
+  triangles.clear();
+  for (const LeafType type :
+       {LeafType::Sphere, LeafType::Triangle, LeafType::Generic}) {
+    for (BVHNode &node : nodes) {
+      if (!node.is_leaf() || node.leaf_type != type)
+        continue;
+      const size_t start_idx = node.primitive_index;
+      node.primitive_index = grouped.size();
+      for (size_t i = start_idx; i < start_idx + node.num_primitives; ++i) {
+        const std::shared_ptr<Hittable> &primitive = primitives[i];
+        grouped.push_back(primitive);
+        if (type == LeafType::Sphere)
+          spheres.push_back(static_cast<const Sphere &>(*primitive).packed());
+        else if (type == LeafType::Triangle)
+          triangles.push_back(
+              static_cast<const Triangle &>(*primitive).packed());
+      }
+    }
+  }
+  primitives.swap(grouped);
+}
+
+real BVHFlatTree::sah_cost() const {
+  real cost = 0.0;
+  for (const BVHNode &node : nodes) {
+    const real area = node.box.surface_area();
+    cost += node.is_leaf() ? area * node.num_primitives
+                           : area * BVHTree::node_traversal_cost;
+  }
+  return cost / nodes[0].box.surface_area();
+}
+
+bool BVHFlatTree::refit(const real max_sah_degradation,
+                        const size_t num_threads) {
+  Timer timer;
+  refit_subtree(0, primitives.size() >= BVHTree::min_parallel_primitives
+                      ? num_threads
+                      : 1);
+  const real cost = sah_cost();
+  fmt::println("Refit BVHFlatTree on {} primitives in {:.3f} ns, SAH cost "
+               "{:.2f} (built at {:.2f})",
+               primitives.size(), timer.elapsed_nanoseconds(), cost,
+               built_sah_cost);
+  if (cost <= max_sah_degradation * built_sah_cost)
+    return false;
+
+  // A spatial split tree's primitives list every reference, so rebuilding
+  // from them would duplicate each split primitive again
+  if (builder == BVHBuilder::SpatialSplit && unique_primitives.empty())
+    throw std::runtime_error("Cannot rebuild a spatial split BVHFlatTree "
+                             "without its unique primitives");
+  const std::shared_ptr<BVHFlatTree> rebuilt = build_bvh(
+      unique_primitives.empty() ? primitives : unique_primitives, builder,
+      num_threads);
+  nodes.swap(rebuilt->nodes);
+  primitives.swap(rebuilt->primitives);
+  spheres.swap(rebuilt->spheres);
+  triangles.swap(rebuilt->triangles);
+  depth = rebuilt->depth;
+  built_sah_cost = rebuilt->built_sah_cost;
+  return true;
+}
+
+BoundingBox BVHFlatTree::refit_subtree(const size_t node_idx,
+                                       const size_t num_threads) {
+  BVHNode &node = nodes[node_idx];
+  BoundingBox box;
+  if (node.is_leaf()) {
+    for (size_t i = node.primitive_index;
+         i < node.primitive_index + node.num_primitives; ++i) {
+      const Hittable &primitive = *primitives[i];
+      box.union_with(primitive.bounding_box());
+      if (node.leaf_type == LeafType::Sphere)
+        spheres[i] = static_cast<const Sphere &>(primitive).packed();
+      else if (node.leaf_type == LeafType::Triangle)
+        triangles[i - spheres.size()] =
+            static_cast<const Triangle &>(primitive).packed();
+    }
+  } else if (num_threads > 1) {
+    const size_t left_threads = num_threads / 2;
+    BoundingBox left_box;
+    std::thread left_thread([&]() {
+      left_box = refit_subtree(node.child_index, left_threads);
+    });
+    box = refit_subtree(node.child_index + 1, num_threads - left_threads);
+    left_thread.join();
+    box.union_with(left_box);
+  } else {
+    box = BoundingBox::box_union(refit_subtree(node.child_index, 1),
+                                 refit_subtree(node.child_index + 1, 1));
+  }
+  node.box = box;
+  return box;
+}
+
+void BVHFlatTree::reorder_for_cache() {
+  Timer timer;
+  if (nodes[0].is_leaf())
+    return;
+
+  // A sibling pair still to be placed: where it is in nodes, the parent in
+  // reordered that must point to it, and that parent's surface area
+  struct PendingPair {
+    uint32_t old_idx, parent_idx;
+    real parent_area;
+    bool operator<(const PendingPair &other) const {
+      return parent_area < other.parent_area;
+    }
+  };
+
+  NodeArray reordered;
+  reordered.reserve(nodes.size());
+  reordered.push_back(nodes[0]);
+  std::deque<PendingPair> block_roots = {{nodes[0].child_index, 0, 0.0}};
+  while (!block_roots.empty()) {
+    std::priority_queue<PendingPair> treelet;
+    treelet.push(block_roots.front());
+    block_roots.pop_front();
+    for (size_t i = 0; i < pairs_per_block && !treelet.empty(); ++i) {
+      const PendingPair pair = treelet.top();
+      treelet.pop();
+      const uint32_t pair_idx = reordered.size();
+      reordered[pair.parent_idx].child_index = pair_idx;
+      for (uint32_t child = 0; child < 2; ++child) {
+        const BVHNode &node = nodes[pair.old_idx + child];
+        reordered.push_back(node);
+        if (!node.is_leaf())
+          treelet.push({node.child_index, pair_idx + child,
+                        node.box.surface_area()});
+      }
+    }
+    // Whatever didn't fit roots a later block
+    for (; !treelet.empty(); treelet.pop())
+      block_roots.push_back(treelet.top());
+  }
+  nodes.swap(reordered);
+
+  fmt::println("Reordered {} BVHFlatTree nodes into blocks of {} sibling "
+               "pairs in {:.3f} ns",
+               nodes.size(), pairs_per_block, timer.elapsed_nanoseconds());
+}
+
+inline bool BVHFlatTree::hit_leaf(const BVHNode &leaf, const Ray &ray,
+                                  const real t_min, real &closest_so_far,
+                                  HitRecord &record) const {
+  bool hit_anything = false;
+  const auto test = [&](const auto &primitive) {
+    if (primitive.hit(ray, t_min, closest_so_far, record)) {
+      hit_anything = true;
+      closest_so_far = record.t;
+    }
+  };
+  const size_t start_idx = leaf.primitive_index;
+  const size_t end_idx = start_idx + leaf.num_primitives;
+  switch (leaf.leaf_type) {
+  case LeafType::Sphere:
+    for (size_t i = start_idx; i < end_idx; ++i)
+      test(spheres[i]);
+    break;
+  case LeafType::Triangle:
+    for (size_t i = start_idx; i < end_idx; ++i)
+      test(triangles[i - spheres.size()]);
+    break;
+  default:
+    for (size_t i = start_idx; i < end_idx; ++i)
+      test(*primitives[i]);
+  }
+  return hit_anything;
+}
+
+inline bool BVHFlatTree::occluded_leaf(const BVHNode &leaf, const Ray &ray,
+                                       const real t_min,
+                                       const real t_max) const {
+  const size_t start_idx = leaf.primitive_index;
+  const size_t end_idx = start_idx + leaf.num_primitives;
+  switch (leaf.leaf_type) {
+  case LeafType::Sphere:
+    for (size_t i = start_idx; i < end_idx; ++i)
+      if (spheres[i].occluded(ray, t_min, t_max))
+        return true;
+    return false;
+  case LeafType::Triangle:
+    for (size_t i = start_idx; i < end_idx; ++i)
+      if (triangles[i - spheres.size()].occluded(ray, t_min, t_max))
+        return true;
+    return false;
+  default:
+    for (size_t i = start_idx; i < end_idx; ++i)
+      if (primitives[i]->occluded(ray, t_min, t_max))
+        return true;
+    return false;
   }
 }
 
 bool BVHFlatTree::recursive_hit(const Ray &ray, const real t_min,
                                 const real t_max, HitRecord &record,
-                                const size_t node_idx) const {
+                                const size_t node_idx,
+                                TraversalCounter &counter) const {
   if (record.t <= t_min)
     return false;
 
+  counter.visit_nodes();
   const BVHNode &node = nodes[node_idx];
   if (node.is_leaf()) {
+    counter.test_primitives(node.num_primitives);
     real closest_so_far = t_max;
-    bool hit_anything = false;
-
-    for (size_t i = 0; i < node.num_primitives; ++i) {
-      const std::shared_ptr<Hittable> primitive =
-          primitives[node.primitive_index + i];
-      if (primitive->hit(ray, t_min, closest_so_far, record)) {
-        hit_anything = true;
-        closest_so_far = record.t;
-      }
-    }
-
-    return hit_anything;
+    return hit_leaf(node, ray, t_min, closest_so_far, record);
   }
 
-  const size_t left_index = node_idx + 1;
-  const size_t right_index = node.right_index;
+  const size_t left_index = node.child_index;
+  const size_t right_index = node.child_index + 1;
   const BVHNode &left_node = nodes[left_index];
   const BVHNode &right_node = nodes[right_index];
 
+  counter.test_boxes(2);
   const auto left_interval = left_node.box.hit_interval(ray, t_min, t_max);
   const auto right_interval = right_node.box.hit_interval(ray, t_min, t_max);
   const bool left_valid = left_interval.has_value();
@@ -147,10 +559,12 @@ bool BVHFlatTree::recursive_hit(const Ray &ray, const real t_min,
     return false;
   } else if (left_valid && !right_valid) {
     const auto &[left_min, left_max] = left_interval.value();
-    return recursive_hit(ray, left_min, left_max, record, left_index);
+    return recursive_hit(ray, left_min, left_max, record, left_index,
+                         counter);
   } else if (!left_valid && right_valid) {
     const auto &[right_min, right_max] = right_interval.value();
-    return recursive_hit(ray, right_min, right_max, record, right_index);
+    return recursive_hit(ray, right_min, right_max, record, right_index,
+                         counter);
   } else {
     const auto &[left_min, left_max] = left_interval.value();
     const auto &[right_min, right_max] = right_interval.value();
@@ -158,16 +572,188 @@ bool BVHFlatTree::recursive_hit(const Ray &ray, const real t_min,
     const bool left_first = left_max < right_max;
     if (left_first) {
       const bool hit_left =
-          recursive_hit(ray, left_min, left_max, record, left_index);
+          recursive_hit(ray, left_min, left_max, record, left_index,
+                        counter);
       const bool hit_right =
-          recursive_hit(ray, right_min, right_max, record, right_index);
+          recursive_hit(ray, right_min, right_max, record, right_index,
+                        counter);
       return hit_left | hit_right;
     } else {
       const bool hit_right =
-          recursive_hit(ray, right_min, right_max, record, right_index);
+          recursive_hit(ray, right_min, right_max, record, right_index,
+                        counter);
       const bool hit_left =
-          recursive_hit(ray, left_min, left_max, record, left_index);
+          recursive_hit(ray, left_min, left_max, record, left_index,
+                        counter);
       return hit_left | hit_right;
     }
   }
 }
+
+bool BVHFlatTree::iterative_hit(const Ray &ray, const real t_min,
+                                const real t_max, HitRecord &record) const {
+  TraversalCounter counter;
+  counter.test_boxes(1);
+  const PrecomputedRay precomputed(ray);
+  real closest_so_far = std::min(t_max, record.t);
+  if (nodes[0].box.hit_distance(precomputed, t_min, closest_so_far) ==
+      INFINITY)
+    return false;
+
+  // Far children, along with where the ray enters them
+  std::array<std::pair<uint32_t, real>, max_stack_depth> stack;
+  size_t stack_size = 0;
+  bool hit_anything = false;
+  uint32_t node_idx = 0;
+
+  for (;;) {
+    counter.visit_nodes();
+    const BVHNode &node = nodes[node_idx];
+    if (node.is_leaf()) {
+      counter.test_primitives(node.num_primitives);
+      hit_anything |= hit_leaf(node, ray, t_min, closest_so_far, record);
+    } else {
+      uint32_t near_idx = node.child_index, far_idx = node.child_index + 1;
+      if (precomputed.direction_is_negative[node.axis])
+        std::swap(near_idx, far_idx);
+      counter.test_boxes(2);
+      const real near_t =
+          nodes[near_idx].box.hit_distance(precomputed, t_min, closest_so_far);
+      const real far_t =
+          nodes[far_idx].box.hit_distance(precomputed, t_min, closest_so_far);
+
+      if (near_t != INFINITY) {
+        if (far_t != INFINITY)
+          stack[stack_size++] = {far_idx, far_t};
+        node_idx = near_idx;
+        continue;
+      }
+      if (far_t != INFINITY) {
+        node_idx = far_idx;
+        continue;
+      }
+    }
+
+    // Pop the next far child the ray can still reach before the closest hit
+    while (stack_size > 0 && stack[stack_size - 1].second >= closest_so_far)
+      --stack_size;
+    if (stack_size == 0)
+      return hit_anything;
+    node_idx = stack[--stack_size].first;
+  }
+}
+
+bool BVHFlatTree::occluded(const Ray &ray, const real t_min,
+                           const real t_max) const {
+  // Every pop pushes at most two nodes one level down, so the stack never
+  // holds more than one node per level
+  std::array<uint32_t, max_stack_depth> local_stack;
+  std::vector<uint32_t> heap_stack;
+  uint32_t *stack = local_stack.data();
+  if (depth > max_stack_depth) {
+    heap_stack.resize(depth);
+    stack = heap_stack.data();
+  }
+
+  TraversalCounter counter;
+  const PrecomputedRay precomputed(ray);
+  size_t stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const uint32_t node_idx = stack[--stack_size];
+    const BVHNode &node = nodes[node_idx];
+    counter.test_boxes(1);
+    if (node.box.hit_distance(precomputed, t_min, t_max) == INFINITY)
+      continue;
+
+    counter.visit_nodes();
+    if (node.is_leaf()) {
+      counter.test_primitives(node.num_primitives);
+      if (occluded_leaf(node, ray, t_min, t_max))
+        return true;
+      continue;
+    }
+    stack[stack_size++] = node.child_index + 1;
+    stack[stack_size++] = node.child_index;
+  }
+  return false;
+}
+
+template <size_t N>
+uint32_t BVHFlatTree::hit_packet(const RayPacket<N> &packet, const real t_min,
+                                 HitRecord *records) const {
+  if (depth > max_stack_depth) {
+    uint32_t result = 0;
+    for (size_t lane = 0; lane < N; ++lane)
+      if ((packet.active_mask & (1u << lane)) &&
+          hit(packet.rays[lane], t_min, records[lane].t, records[lane]))
+        result |= 1u << lane;
+    return result;
+  }
+
+  // Counted per lane, so the averages are comparable with single rays'
+  TraversalCounter counter(std::popcount(packet.active_mask));
+  counter.test_boxes(std::popcount(packet.active_mask));
+  std::array<real, N> t_max;
+  for (size_t lane = 0; lane < N; ++lane)
+    t_max[lane] = records[lane].t;
+
+  // Each entry is a node along with the lanes whose rays enter its box
+  std::array<std::pair<uint32_t, uint32_t>, max_stack_depth> stack;
+  size_t stack_size = 0;
+  uint32_t result = 0;
+
+  const uint32_t root_mask =
+      nodes[0].box.hit_packet(packet, t_min, t_max, packet.active_mask);
+  if (root_mask != 0)
+    stack[stack_size++] = {0, root_mask};
+
+  while (stack_size > 0) {
+    const auto [node_idx, mask] = stack[--stack_size];
+    const BVHNode &node = nodes[node_idx];
+    counter.visit_nodes(std::popcount(mask));
+
+    if (node.is_leaf()) {
+      counter.test_primitives(std::popcount(mask) * node.num_primitives);
+      for (size_t lane = 0; lane < N; ++lane) {
+        if ((mask & (1u << lane)) && hit_leaf(node, packet.rays[lane], t_min,
+                                              t_max[lane], records[lane]))
+          result |= 1u << lane;
+      }
+      continue;
+    }
+
+    const uint32_t left_index = node.child_index;
+    const uint32_t right_index = node.child_index + 1;
+    counter.test_boxes(2 * std::popcount(mask));
+    const uint32_t left_mask =
+        nodes[left_index].box.hit_packet(packet, t_min, t_max, mask);
+    const uint32_t right_mask =
+        nodes[right_index].box.hit_packet(packet, t_min, t_max, mask);
+
+    // Visit the child nearer to the first lane's origin first; the packet is
+    // coherent, so this is usually right for every lane
+    const size_t first_lane = std::countr_zero(mask);
+    const bool left_first =
+        packet.inv_directions[node.axis][first_lane] >= 0.0;
+    const std::pair<uint32_t, uint32_t> near = {
+        left_first ? left_index : right_index,
+        left_first ? left_mask : right_mask};
+    const std::pair<uint32_t, uint32_t> far = {
+        left_first ? right_index : left_index,
+        left_first ? right_mask : left_mask};
+    if (far.second != 0)
+      stack[stack_size++] = far;
+    if (near.second != 0)
+      stack[stack_size++] = near;
+  }
+
+  return result;
+}
+
+template uint32_t BVHFlatTree::hit_packet<4>(const RayPacket<4> &, const real,
+                                             HitRecord *) const;
+template uint32_t BVHFlatTree::hit_packet<8>(const RayPacket<8> &, const real,
+                                             HitRecord *) const;
+template uint32_t BVHFlatTree::hit_packet<16>(const RayPacket<16> &, const real,
+                                              HitRecord *) const;
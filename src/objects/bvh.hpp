@@ -2,10 +2,16 @@
 #pragma once
 
 #include "objects/bounding_box.hpp"
+#include "objects/bvh_stats.hpp"
 #include "objects/hit_record.hpp"
 #include "objects/hittable.hpp"
+#include "objects/sphere.hpp"
+#include "objects/triangle.hpp"
 #include "util/timer.hpp"
+#include <bit>
 #include <cmath>
+#include <new>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -16,83 +22,342 @@ struct BVHTree {
     std::vector<std::shared_ptr<Hittable>> primitives;
     BoundingBox box;
     int axis;
+    // Sizes of the subtree rooted here, so it can be flattened into a slot
+    // reserved ahead of time
+    size_t subtree_nodes, subtree_primitives;
 
     BVHTreeNode(const std::vector<std::shared_ptr<Hittable>> &primitives,
                 const BoundingBox &box)
-        : primitives(primitives), box(box) {}
+        : primitives(primitives), box(box), subtree_nodes(1),
+          subtree_primitives(primitives.size()) {}
     BVHTreeNode(std::shared_ptr<BVHTreeNode> left,
                 std::shared_ptr<BVHTreeNode> right, const int axis)
         : left(left), right(right),
-          box(BoundingBox::box_union(left->box, right->box)), axis(axis) {}
+          box(BoundingBox::box_union(left->box, right->box)), axis(axis),
+          subtree_nodes(1 + left->subtree_nodes + right->subtree_nodes),
+          subtree_primitives(left->subtree_primitives +
+                             right->subtree_primitives) {}
   };
 
+  // A primitive's bounds and centroid, cached so choosing splits never calls
+  // the virtual Hittable::bounding_box(). Splits reorder these in place.
+  struct BuildPrimitive {
+    BoundingBox box;
+    vec3 centroid;
+    uint32_t index; // Into primitives
+  };
+
+  // Nodes with at most this many primitives try a split between every pair of
+  // neighbouring primitives; larger nodes only try the boundaries between
+  // num_bins equal-width bins of their centroid bounds
+  static constexpr size_t max_exact_sweep_primitives = 32;
+  static constexpr size_t num_bins = 32;
+  // Nodes with fewer primitives than this are built on a single thread; above
+  // it, binning is split across threads and subtrees are built concurrently
+  static constexpr size_t min_parallel_primitives = 1 << 14;
+  // The SAH cost of traversing a node, relative to intersecting a primitive
+  static constexpr real node_traversal_cost = 0.125;
+
   std::shared_ptr<BVHTreeNode> root;
   std::vector<std::shared_ptr<Hittable>> primitives;
+  std::vector<BuildPrimitive> build_primitives;
 
-  BVHTree(const std::vector<std::shared_ptr<Hittable>> &primitives)
-      : primitives(primitives) {
-    root = construct(0, primitives.size());
-  }
+  // Builds on up to num_threads threads. Splits only depend on the
+  // primitives, so the tree is the same whatever the thread count.
+  BVHTree(const std::vector<std::shared_ptr<Hittable>> &primitives,
+          const size_t num_threads = default_num_threads());
   virtual ~BVHTree() {}
 
+  // Chooses how to split build_primitives[start_idx, end_idx) and partitions
+  // them accordingly. Returns the split axis and the index of the first
+  // primitive on the right, or nullopt if the node should be a leaf.
   std::optional<std::pair<int, size_t>>
-  split_and_partition(const size_t start_idx, const size_t end_idx);
+  split_and_partition(const size_t start_idx, const size_t end_idx,
+                      const size_t num_threads = 1);
 
   std::shared_ptr<BVHTreeNode> construct(const size_t start_idx,
-                                         const size_t end_idx);
+                                         const size_t end_idx,
+                                         const size_t num_threads = 1);
+
+private:
+  struct Split {
+    int axis = 0;
+    size_t mid_idx = 0;
+    real cost = INFINITY;
+  };
+
+  Split sweep_split(const size_t start_idx, const size_t end_idx,
+                    const BoundingBox &bounds);
+  std::optional<Split> binned_split(const size_t start_idx,
+                                    const size_t end_idx,
+                                    const BoundingBox &bounds,
+                                    const BoundingBox &centroid_bounds,
+                                    const size_t num_threads);
+};
+
+// Whether BVHFlatTree nodes store their bounds as CompactBoundingBox (32-byte
+// nodes) or as BoundingBox (64-byte nodes, or 32-byte ones in single-precision
+// builds). Set with the CMake option of the same name; off until compact nodes
+// are measured to pay off.
+#ifndef SPECTRAL_COMPACT_BVH_NODES
+#define SPECTRAL_COMPACT_BVH_NODES 0
+#endif
+
+// Allocates BVHFlatTree node arrays so that nodes[1], where the first sibling
+// pair starts, is aligned to the size of a pair, or to a page for arrays
+// spanning a few pages. Every pair then fills one pair_size-aligned block: a
+// single cache line with 32-byte nodes, two neighbouring lines with 64-byte
+// ones.
+template <typename T> struct BVHNodeAllocator {
+  using value_type = T;
+  static constexpr size_t cache_line_size = 64;
+  static constexpr size_t page_size = 4096;
+  static constexpr size_t pair_size = 2 * sizeof(T);
+  static_assert(page_size % pair_size == 0);
+
+  BVHNodeAllocator() = default;
+  template <typename U> BVHNodeAllocator(const BVHNodeAllocator<U> &) {}
+
+  T *allocate(const size_t n) {
+    void *base = ::operator new(n * sizeof(T) + offset(n),
+                                std::align_val_t(alignment(n)));
+    return reinterpret_cast<T *>(static_cast<char *>(base) + offset(n));
+  }
+  void deallocate(T *p, const size_t n) {
+    ::operator delete(reinterpret_cast<char *>(p) - offset(n),
+                      std::align_val_t(alignment(n)));
+  }
+  bool operator==(const BVHNodeAllocator &) const { return true; }
+
+private:
+  static size_t alignment(const size_t n) {
+    return n * sizeof(T) >= 4 * page_size
+               ? page_size
+               : std::max(cache_line_size, pair_size);
+  }
+  // Puts the second element on an alignment boundary
+  static size_t offset(const size_t n) {
+    return (alignment(n) - sizeof(T) % alignment(n)) % alignment(n);
+  }
 };
 
+struct LinearBVH;
+struct SpatialSplitBVH;
+
+// Which builder scenes make their BVHFlatTree with
+enum class BVHBuilder : uint32_t {
+  SAH,          // Binned SAH over whole primitives
+  SpatialSplit, // SpatialSplitBVH, which pays off on triangle meshes
+};
+
+// The root is nodes[0]. The two children of an inner node sit side by side
+// from child_index, and always come after their parent, so the two boxes
+// traversal tests at each step share one aligned block of 2 * sizeof(BVHNode)
+// bytes. construct() writes pairs in depth-first order; reorder_for_cache()
+// regroups them into treelets of at most a page each.
+//
+// Leaves holding only spheres or only triangles are tagged with that type, and
+// the traversal kernels test them against packed copies in the spheres or
+// triangles array, inlined, instead of calling Hittable::hit() through
+// primitives. pack_primitives() groups primitives by leaf type so that a
+// tagged leaf's primitive_index also locates its copies: spheres come first,
+// then triangles, then the primitives of generic leaves.
 struct BVHFlatTree : public Hittable {
-  struct BVHNode {
-    BoundingBox box;
-    uint8_t axis;
+  using NodeBox = std::conditional_t<SPECTRAL_COMPACT_BVH_NODES,
+                                     CompactBoundingBox, BoundingBox>;
+
+  // Which array a leaf's primitives are tested from
+  enum class LeafType : uint8_t { Generic, Sphere, Triangle };
+
+  // What a node holds: its box, then an index, a count, an axis and a type
+  static constexpr size_t node_fields_size =
+      sizeof(NodeBox) + sizeof(uint32_t) + sizeof(uint16_t) +
+      sizeof(uint8_t) + sizeof(LeafType);
+
+  // Padded and aligned to the next power of two, so no node ever straddles a
+  // cache line: 32 bytes with float bounds, 64 with double ones
+  struct alignas(std::bit_ceil(node_fields_size)) BVHNode {
+    NodeBox box;
     union {
       uint32_t primitive_index; // leaf node
-      uint32_t right_index;     // internal node
+      uint32_t child_index;     // internal node: left child, then right
     };
     uint16_t num_primitives;
+    uint8_t axis;
+    LeafType leaf_type; // leaf node, set by pack_primitives()
 
+    BVHNode() = default;
     BVHNode(const BoundingBox &box, const uint8_t axis, const uint32_t index,
             const uint16_t num_primitives)
-        : box(box), axis(axis), right_index(index),
-          num_primitives(num_primitives) {}
+        : box(box), child_index(index), num_primitives(num_primitives),
+          axis(axis), leaf_type(LeafType::Generic) {}
 
     bool is_leaf() const { return num_primitives > 0; }
   };
+  static_assert(sizeof(BVHNode) == alignof(BVHNode));
+  using NodeArray = std::vector<BVHNode, BVHNodeAllocator<BVHNode>>;
+
+  // Deepest traversal stack the iterative kernels support; deeper trees fall
+  // back to tracing recursively
+  static constexpr size_t max_stack_depth = 64;
+
+  // Sibling pairs in each of reorder_for_cache()'s blocks: a page's worth of
+  // whatever size nodes this build uses
+  static constexpr size_t pairs_per_block =
+      BVHNodeAllocator<BVHNode>::page_size /
+      BVHNodeAllocator<BVHNode>::pair_size;
+
+  // Refits that leave the tree this many times as costly as when it was built
+  // rebuild it instead
+  static constexpr real default_max_sah_degradation = 1.5;
 
-  std::vector<BVHNode> nodes;
+  NodeArray nodes;
   std::vector<std::shared_ptr<Hittable>> primitives;
+  // Copies of primitives[0, spheres.size()) and of the triangles after them
+  std::vector<PackedSphere> spheres;
+  std::vector<PackedTriangle> triangles;
+  size_t depth = 0;
+  // sah_cost() when the tree was last built, which refits are measured against
+  real built_sah_cost = 0.0;
+  // What refit() rebuilds the tree with: the builder that made it, and each
+  // of its primitives once. unique_primitives is only filled in for trees
+  // whose leaves share primitives; otherwise primitives lists each once.
+  BVHBuilder builder = BVHBuilder::SAH;
+  std::vector<std::shared_ptr<Hittable>> unique_primitives;
 
-  BVHFlatTree(const std::vector<std::shared_ptr<Hittable>> &primitives) {
+  BVHFlatTree(const std::vector<std::shared_ptr<Hittable>> &primitives,
+              const size_t num_threads = default_num_threads()) {
     Timer timer;
-    nodes.reserve(2 * primitives.size() - 1);
-    this->primitives.reserve(primitives.size());
-    const auto bvh = std::make_shared<BVHTree>(primitives);
-    construct(bvh->root);
+    const auto bvh = std::make_shared<BVHTree>(primitives, num_threads);
+    nodes.resize(bvh->root->subtree_nodes);
+    this->primitives.resize(bvh->root->subtree_primitives);
+    construct(bvh->root, 0, 1, 0, num_threads);
+    pack_primitives();
+    depth = compute_depth(0);
+    built_sah_cost = sah_cost();
 
     const real elapsed_nanoseconds = timer.elapsed_nanoseconds();
     fmt::println(
         "Constructed BVHFlatTree on {} primitives, using {} nodes in {:.3f} ns",
         primitives.size(), nodes.size(), elapsed_nanoseconds);
+  }
 
-    // Find the node with the most primitives
-    uint16_t max_primitives = 0;
-    for (const auto &node : nodes)
-      max_primitives = std::max(max_primitives, node.num_primitives);
-    fmt::println("Max primitives in a node: {}", max_primitives);
+  // Adopts a tree that has already been flattened, e.g. one loaded from a
+  // snapshot
+  BVHFlatTree(NodeArray nodes,
+              std::vector<std::shared_ptr<Hittable>> primitives)
+      : nodes(std::move(nodes)), primitives(std::move(primitives)) {
+    pack_primitives();
+    depth = compute_depth(0);
+    built_sah_cost = sah_cost();
   }
 
+  // Flattens a linear BVH, collapsing the subtrees it marks as leaves.
+  // Defined in lbvh.cpp.
+  explicit BVHFlatTree(const LinearBVH &lbvh);
+
+  // Flattens a spatial split BVH, whose leaves may share primitives. Defined
+  // in sbvh.cpp.
+  explicit BVHFlatTree(const SpatialSplitBVH &sbvh);
+
   virtual ~BVHFlatTree() {}
 
-  size_t construct(std::shared_ptr<BVHTree::BVHTreeNode> node);
+  // Writes node to nodes[node_idx], its descendants' sibling pairs
+  // depth-first from nodes[descendants_idx], and its primitives from
+  // primitives[primitive_idx]. Subtree sizes are known up front, so left and
+  // right subtrees can be written by different threads.
+  void construct(const std::shared_ptr<BVHTree::BVHTreeNode> &node,
+                 const size_t node_idx, const size_t descendants_idx,
+                 const size_t primitive_idx, const size_t num_threads = 1);
+  size_t compute_depth(const size_t node_idx) const;
+
+  // Tags every leaf with its type, reorders primitives into the sphere,
+  // triangle and generic ranges and refills the packed arrays. Every
+  // constructor calls this once the nodes are written.
+  void pack_primitives();
+
+  // Expected cost of tracing a ray through the tree under the surface area
+  // heuristic, relative to intersecting one primitive
+  real sah_cost() const;
+
+  // Updates every node's bounds bottom-up from the primitives' current bounds,
+  // keeping the tree's topology, for primitives that moved in place. Leaves of
+  // spatial split trees grow from their clipped bounds to whole primitives',
+  // since the split planes aren't kept. If that leaves sah_cost() more than
+  // max_sah_degradation times built_sah_cost, the tree is rebuilt from scratch
+  // with its builder instead. Returns whether it was rebuilt. Must not run
+  // while rays are being traced.
+  bool refit(const real max_sah_degradation = default_max_sah_degradation,
+             const size_t num_threads = default_num_threads());
+
+  // Refits the subtree rooted at nodes[node_idx], along with the packed
+  // copies of its primitives, returning its bounds. The two subtrees of a node
+  // can be refit by different threads.
+  BoundingBox refit_subtree(const size_t node_idx, const size_t num_threads);
+
+  // Regroups the nodes into blocks of up to pairs_per_block sibling pairs,
+  // each a treelet grown top-down by repeatedly adding the children of its
+  // largest node, the one rays are likeliest to enter. Blocks are stored back
+  // to back, so a block spans at most two pages; a ray's path down the tree
+  // then stays within them for several levels at a time, instead of leaving
+  // its page at almost every one. Must not run while rays are being traced.
+  void reorder_for_cache();
 
   virtual bool hit(const Ray &ray, const real t_min, const real t_max,
                    HitRecord &record) const override {
-    return recursive_hit(ray, t_min, t_max, record, 0);
+    if (depth > max_stack_depth)
+      return recursive_hit(ray, t_min, t_max, record, 0);
+    return iterative_hit(ray, t_min, t_max, record);
   }
 
+  // Walks the tree with an explicit stack, visiting the child on the near side
+  // of each node's split axis first. Far children wait on the stack with the
+  // distance at which the ray enters them, and are skipped if a closer hit has
+  // been found by the time they are popped. Needs depth <= max_stack_depth.
+  bool iterative_hit(const Ray &ray, const real t_min, const real t_max,
+                     HitRecord &record) const;
+
   bool recursive_hit(const Ray &ray, real t_min, real t_max, HitRecord &record,
-                     const size_t node_idx) const;
+                     const size_t node_idx) const {
+    TraversalCounter counter;
+    return recursive_hit(ray, t_min, t_max, record, node_idx, counter);
+  }
+
+  // Any hit ends the query, so children are visited in whatever order they
+  // come and nothing needs to remember where the ray enters them
+  virtual bool occluded(const Ray &ray, const real t_min,
+                        const real t_max) const override;
+
+  virtual uint32_t hit_packet(const RayPacket<packet_size> &packet,
+                              const real t_min,
+                              HitRecord *records) const override {
+    return hit_packet<packet_size>(packet, t_min, records);
+  }
+
+  // Traverses the tree once for the whole packet: each node's box is tested
+  // against every lane still interested in it, and a subtree is only visited
+  // if some lane enters it. Instantiated for 4, 8 and 16 lanes.
+  template <size_t N>
+  uint32_t hit_packet(const RayPacket<N> &packet, const real t_min,
+                      HitRecord *records) const;
 
   virtual BoundingBox bounding_box() const override { return nodes[0].box; }
+
+private:
+  // Tests a leaf's primitives for hits closer than closest_so_far, which
+  // shrinks to each one found
+  bool hit_leaf(const BVHNode &leaf, const Ray &ray, const real t_min,
+                real &closest_so_far, HitRecord &record) const;
+  bool occluded_leaf(const BVHNode &leaf, const Ray &ray, const real t_min,
+                     const real t_max) const;
+  // The whole descent shares the caller's counter
+  bool recursive_hit(const Ray &ray, real t_min, real t_max, HitRecord &record,
+                     const size_t node_idx, TraversalCounter &counter) const;
 };
+
+// Builds a BVHFlatTree over primitives with the given builder, on up to
+// num_threads threads where it can. Defined in sbvh.cpp.
+std::shared_ptr<BVHFlatTree>
+build_bvh(const std::vector<std::shared_ptr<Hittable>> &primitives,
+          const BVHBuilder builder,
+          const size_t num_threads = default_num_threads());
@@ -0,0 +1,313 @@
+#include "bvh_snapshot.hpp"
+
+#include "objects/sphere.hpp"
+#include "objects/triangle.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+constexpr uint64_t section_alignment = 64;
+
+uint64_t align_up(const uint64_t offset) {
+  return (offset + section_alignment - 1) / section_alignment *
+         section_alignment;
+}
+
+// A read-only mapping of a whole file, or nothing if it can't be mapped
+struct MappedFile {
+  const char *data = nullptr;
+  size_t size = 0;
+
+  explicit MappedFile(const std::string &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat info;
+    if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+      void *mapped =
+          ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data = static_cast<const char *>(mapped);
+        size = info.st_size;
+      }
+    }
+    ::close(fd);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() {
+    if (data != nullptr)
+      ::munmap(const_cast<char *>(data), size);
+  }
+
+  // Whether count objects of type T fit at offset
+  template <typename T>
+  bool contains(const uint64_t offset, const uint64_t count) const {
+    return offset <= size && count <= (size - offset) / sizeof(T);
+  }
+};
+
+// Materials numbered in the order they first appear
+struct MaterialTable {
+  std::vector<std::shared_ptr<Material>> materials;
+  std::unordered_map<const Material *, uint32_t> indices;
+
+  uint32_t index(const std::shared_ptr<Material> &material) {
+    const auto [it, inserted] =
+        indices.try_emplace(material.get(), materials.size());
+    if (inserted)
+      materials.push_back(material);
+    return it->second;
+  }
+};
+
+SnapshotPrimitive encode(const Hittable &primitive, MaterialTable &materials) {
+  SnapshotPrimitive result = {};
+  if (const auto *sphere = dynamic_cast<const Sphere *>(&primitive)) {
+    result.type = SnapshotPrimitiveType::Sphere;
+    result.material = materials.index(sphere->material);
+    result.geometry = {sphere->center.x, sphere->center.y, sphere->center.z,
+                       sphere->radius};
+  } else if (const auto *triangle =
+                 dynamic_cast<const Triangle *>(&primitive)) {
+    result.type = SnapshotPrimitiveType::Triangle;
+    result.material = materials.index(triangle->m_material);
+    result.geometry = {triangle->a.x, triangle->a.y, triangle->a.z,
+                       triangle->b.x, triangle->b.y, triangle->b.z,
+                       triangle->c.x, triangle->c.y, triangle->c.z};
+  } else {
+    throw std::runtime_error(
+        "Only spheres and triangles can be stored in a BVH snapshot");
+  }
+  return result;
+}
+
+// FNV-1a over the encoded primitives, which have no padding
+uint64_t content_hash(const std::vector<SnapshotPrimitive> &primitives) {
+  static_assert(sizeof(SnapshotPrimitive) ==
+                2 * sizeof(uint32_t) + 9 * sizeof(double));
+  uint64_t hash = 0xcbf29ce484222325;
+  const auto *bytes =
+      reinterpret_cast<const unsigned char *>(primitives.data());
+  for (size_t i = 0; i < primitives.size() * sizeof(SnapshotPrimitive); ++i)
+    hash = (hash ^ bytes[i]) * 0x100000001b3;
+  return hash;
+}
+
+std::optional<std::shared_ptr<BVHFlatTree>>
+load(const std::string &path, const uint64_t hash,
+     const std::vector<std::shared_ptr<Material>> &materials,
+     const BVHBuilder builder) {
+  const MappedFile file(path);
+  if (file.data == nullptr || !file.contains<SnapshotHeader>(0, 1))
+    return std::nullopt;
+  SnapshotHeader header;
+  std::memcpy(&header, file.data, sizeof(header));
+  if (header.magic != snapshot_magic || header.version != snapshot_version ||
+      header.node_size != sizeof(BVHFlatTree::BVHNode) ||
+      header.real_size != sizeof(real) ||
+      header.num_materials != materials.size() ||
+      header.content_hash != hash || header.num_nodes == 0 ||
+      !file.contains<BVHFlatTree::BVHNode>(header.nodes_offset,
+                                           header.num_nodes) ||
+      !file.contains<SnapshotPrimitive>(header.primitives_offset,
+                                        header.num_primitives) ||
+      !file.contains<uint32_t>(header.references_offset,
+                               header.num_references))
+    return std::nullopt;
+
+  BVHFlatTree::NodeArray nodes(header.num_nodes);
+  std::memcpy(nodes.data(), file.data + header.nodes_offset,
+              header.num_nodes * sizeof(BVHFlatTree::BVHNode));
+
+  std::vector<SnapshotPrimitive> records(header.num_primitives);
+  std::memcpy(records.data(), file.data + header.primitives_offset,
+              header.num_primitives * sizeof(SnapshotPrimitive));
+  size_t num_spheres = 0;
+  for (const SnapshotPrimitive &record : records) {
+    if (record.material >= materials.size())
+      return std::nullopt;
+    num_spheres += record.type == SnapshotPrimitiveType::Sphere;
+  }
+  std::vector<uint32_t> references(header.num_references);
+  std::memcpy(references.data(), file.data + header.references_offset,
+              header.num_references * sizeof(uint32_t));
+  for (const uint32_t index : references)
+    if (index >= records.size())
+      return std::nullopt;
+
+  // Children always come after their parent, so a tree that passes this can
+  // be walked without going out of bounds or in circles
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const BVHFlatTree::BVHNode &node = nodes[i];
+    const bool valid =
+        node.is_leaf()
+            ? uint64_t(node.primitive_index) + node.num_primitives <=
+                  references.size()
+            : node.child_index > i &&
+                  uint64_t(node.child_index) + 1 < nodes.size();
+    if (!valid)
+      return std::nullopt;
+  }
+
+  // Each type lives in one array, which every primitive pointer aliases;
+  // the arrays never grow past what is reserved, so elements never move
+  const auto spheres = std::make_shared<std::vector<Sphere>>();
+  const auto triangles = std::make_shared<std::vector<Triangle>>();
+  spheres->reserve(num_spheres);
+  triangles->reserve(records.size() - num_spheres);
+  std::vector<std::shared_ptr<Hittable>> unique_primitives;
+  unique_primitives.reserve(records.size());
+  for (const SnapshotPrimitive &record : records) {
+    const auto &g = record.geometry;
+    const std::shared_ptr<Material> &material = materials[record.material];
+    switch (record.type) {
+    case SnapshotPrimitiveType::Sphere:
+      spheres->emplace_back(vec3(g[0], g[1], g[2]), g[3], material);
+      unique_primitives.emplace_back(spheres, &spheres->back());
+      break;
+    case SnapshotPrimitiveType::Triangle:
+      triangles->emplace_back(vec3(g[0], g[1], g[2]), vec3(g[3], g[4], g[5]),
+                              vec3(g[6], g[7], g[8]), material);
+      unique_primitives.emplace_back(triangles, &triangles->back());
+      break;
+    default:
+      return std::nullopt;
+    }
+  }
+
+  std::vector<std::shared_ptr<Hittable>> primitives;
+  primitives.reserve(references.size());
+  for (const uint32_t index : references)
+    primitives.push_back(unique_primitives[index]);
+  const auto bvh = std::make_shared<BVHFlatTree>(std::move(nodes),
+                                                 std::move(primitives));
+  // Leaves of spatial split trees share primitives, so refit() rebuilds them
+  // from the unique ones
+  bvh->builder = builder;
+  if (builder == BVHBuilder::SpatialSplit)
+    bvh->unique_primitives = std::move(unique_primitives);
+  return bvh;
+}
+
+// Writes to a temporary file first, syncs it and renames it into place, so
+// readers never see a partial snapshot. records encodes primitives, the
+// inputs the tree was built over.
+void save(const std::string &path, const BVHFlatTree &bvh, const uint64_t hash,
+          const std::vector<std::shared_ptr<Hittable>> &primitives,
+          const std::vector<SnapshotPrimitive> &records,
+          const MaterialTable &materials) {
+  std::unordered_map<const Hittable *, uint32_t> indices;
+  for (size_t i = 0; i < primitives.size(); ++i)
+    indices.try_emplace(primitives[i].get(), i);
+  std::vector<uint32_t> references;
+  references.reserve(bvh.primitives.size());
+  for (const auto &primitive : bvh.primitives) {
+    const auto it = indices.find(primitive.get());
+    if (it == indices.end())
+      throw std::runtime_error(
+          "BVH snapshot references a primitive it wasn't built over");
+    references.push_back(it->second);
+  }
+
+  SnapshotHeader header = {};
+  header.magic = snapshot_magic;
+  header.version = snapshot_version;
+  header.node_size = sizeof(BVHFlatTree::BVHNode);
+  header.real_size = sizeof(real);
+  header.num_materials = materials.materials.size();
+  header.content_hash = hash;
+  header.num_nodes = bvh.nodes.size();
+  header.nodes_offset = align_up(sizeof(header));
+  header.num_primitives = records.size();
+  header.primitives_offset = align_up(
+      header.nodes_offset + header.num_nodes * sizeof(BVHFlatTree::BVHNode));
+  header.num_references = references.size();
+  header.references_offset =
+      align_up(header.primitives_offset +
+               header.num_primitives * sizeof(SnapshotPrimitive));
+
+  // The temporary file is unique, so concurrent jobs saving the same
+  // snapshot never write into each other's
+  std::string temp_path = path + ".XXXXXX";
+  const int fd = ::mkstemp(temp_path.data());
+  if (fd < 0)
+    throw std::runtime_error(
+        fmt::format("Could not open BVH snapshot '{}' for writing", path));
+  const auto write_at = [&](uint64_t offset, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+      const ssize_t n = ::pwrite(fd, bytes, size, offset);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      bytes += n;
+      offset += n;
+      size -= n;
+    }
+    return true;
+  };
+  // mkstemp only lets the owner read; snapshots are meant to be shared. The
+  // data must reach the disk before the rename, or a crash could leave the
+  // new name pointing at a partial file.
+  bool written =
+      ::fchmod(fd, 0644) == 0 && write_at(0, &header, sizeof(header)) &&
+      write_at(header.nodes_offset, bvh.nodes.data(),
+               bvh.nodes.size() * sizeof(BVHFlatTree::BVHNode)) &&
+      write_at(header.primitives_offset, records.data(),
+               records.size() * sizeof(SnapshotPrimitive)) &&
+      write_at(header.references_offset, references.data(),
+               references.size() * sizeof(uint32_t)) &&
+      ::fsync(fd) == 0;
+  written = ::close(fd) == 0 && written;
+  std::error_code error;
+  if (written)
+    std::filesystem::rename(temp_path, path, error);
+  if (!written || error) {
+    std::filesystem::remove(temp_path, error);
+    throw std::runtime_error(
+        fmt::format("Could not write BVH snapshot '{}'", path));
+  }
+}
+
+} // namespace
+
+std::shared_ptr<BVHFlatTree>
+load_or_build_bvh(const std::vector<std::shared_ptr<Hittable>> &primitives,
+                  const std::string &path, const BVHBuilder builder) {
+  Timer timer;
+  MaterialTable materials;
+  std::vector<SnapshotPrimitive> inputs;
+  inputs.reserve(primitives.size());
+  for (const auto &primitive : primitives)
+    inputs.push_back(encode(*primitive, materials));
+  const uint64_t hash =
+      (content_hash(inputs) ^ static_cast<uint64_t>(builder)) * 0x100000001b3;
+
+  if (auto bvh = load(path, hash, materials.materials, builder)) {
+    fmt::println("Loaded BVH snapshot '{}' ({} nodes, {} primitives) in "
+                 "{:.3f} s",
+                 path, (*bvh)->nodes.size(), (*bvh)->primitives.size(),
+                 timer.elapsed_seconds());
+    return *bvh;
+  }
+
+  fmt::println("BVH snapshot '{}' is missing or stale, rebuilding it", path);
+  const auto bvh = build_bvh(primitives, builder);
+  try {
+    save(path, *bvh, hash, primitives, inputs, materials);
+  } catch (const std::exception &e) {
+    fmt::println("Could not save BVH snapshot: {}", e.what());
+  }
+  return bvh;
+}
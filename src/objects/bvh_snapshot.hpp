@@ -0,0 +1,68 @@
+#pragma once
+
+#include "objects/bvh.hpp"
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Versioned on-disk snapshot of a BVHFlatTree over spheres and triangles, so
+// processes rendering the same scene can map a tree built once instead of
+// each building their own.
+//
+// Layout, with each section starting at a 64-byte aligned offset from the
+// start of the file and every offset stored relative to it:
+//   SnapshotHeader
+//   num_nodes BVHFlatTree::BVHNode, exactly as they are in memory
+//   num_primitives SnapshotPrimitive, one per input primitive, in input order
+//   num_references uint32_t, the index of the primitive behind each of the
+//     tree's primitive references, in the order its leaves use them
+//
+// Spatial split trees reference some primitives from several leaves; storing
+// each primitive once keeps those references sharing one object when loaded,
+// and lets refit() rebuild the loaded tree from its unique primitives.
+//
+// Materials and their textures are not stored. A primitive refers to its
+// material by index, in the order materials first appear among the input
+// primitives, and the caller's freshly built primitives supply them. The
+// header keys the snapshot by a hash of the input geometry, material indices
+// and builder, so a snapshot of a scene that has since changed is never used.
+constexpr std::array<char, 8> snapshot_magic = {'S', 'P', 'E', 'C',
+                                                'S', 'N', 'A', 'P'};
+constexpr uint32_t snapshot_version = 3;
+
+struct SnapshotHeader {
+  std::array<char, 8> magic;
+  uint32_t version;
+  // Layout of the nodes as written; builds that lay them out differently
+  // treat the snapshot as stale
+  uint32_t node_size, real_size;
+  uint32_t num_materials;
+  uint64_t content_hash;
+  uint64_t num_nodes, nodes_offset;
+  uint64_t num_primitives, primitives_offset;
+  uint64_t num_references, references_offset;
+};
+
+enum class SnapshotPrimitiveType : uint32_t {
+  Sphere = 1,
+  Triangle = 2,
+};
+
+struct SnapshotPrimitive {
+  SnapshotPrimitiveType type;
+  uint32_t material;
+  // Sphere: centre and radius. Triangle: its three vertices.
+  std::array<double, 9> geometry;
+};
+
+// Returns a tree over primitives, mapped from the snapshot at path if that was
+// built from the same geometry by the same builder; otherwise builds one and
+// writes it to path, replacing whatever was there. Only Sphere and Triangle
+// primitives can be snapshotted. Loaded primitives share one allocation per
+// type.
+std::shared_ptr<BVHFlatTree>
+load_or_build_bvh(const std::vector<std::shared_ptr<Hittable>> &primitives,
+                  const std::string &path,
+                  const BVHBuilder builder = BVHBuilder::SAH);
@@ -0,0 +1,154 @@
+#include "bvh_stats.hpp"
+
+#include "objects/bvh.hpp"
+
+#include <mutex>
+
+namespace {
+
+// "[a, b, c]"
+std::string json_array(const std::vector<size_t> &values) {
+  std::string result = "[";
+  for (size_t i = 0; i < values.size(); ++i)
+    result += fmt::format("{}{}", i > 0 ? ", " : "", values[i]);
+  return result + "]";
+}
+
+// "d: n, ..." over the nonzero entries
+std::string histogram(const std::vector<size_t> &counts) {
+  std::string result;
+  for (size_t i = 0; i < counts.size(); ++i)
+    if (counts[i] > 0)
+      result += fmt::format("{}{}: {}", result.empty() ? "" : ", ", i,
+                            counts[i]);
+  return result;
+}
+
+real ratio(const real numerator, const real denominator) {
+  return denominator > 0.0 ? numerator / denominator : 0.0;
+}
+
+std::mutex exited_threads_mutex;
+TraversalStats exited_threads_total;
+
+// Folded into exited_threads_total when its thread exits
+struct ThreadTotal {
+  TraversalStats stats;
+  ~ThreadTotal() {
+    std::lock_guard lock(exited_threads_mutex);
+    exited_threads_total += stats;
+  }
+};
+thread_local ThreadTotal thread_total;
+
+} // namespace
+
+BVHStats::BVHStats(const BVHFlatTree &bvh)
+    : num_nodes(bvh.nodes.size()), num_primitives(bvh.primitives.size()),
+      sah_cost(bvh.sah_cost()),
+      node_bytes(bvh.nodes.capacity() * sizeof(BVHFlatTree::BVHNode)),
+      primitive_pointer_bytes(bvh.primitives.capacity() *
+                              sizeof(std::shared_ptr<Hittable>)),
+      packed_primitive_bytes(bvh.spheres.capacity() * sizeof(PackedSphere) +
+                             bvh.triangles.capacity() *
+                                 sizeof(PackedTriangle)) {
+  const real root_area = bvh.nodes[0].box.surface_area();
+  size_t total_leaf_depth = 0;
+  std::vector<std::pair<uint32_t, size_t>> stack = {{0, 1}};
+  while (!stack.empty()) {
+    const auto [node_idx, depth] = stack.back();
+    stack.pop_back();
+    const BVHFlatTree::BVHNode &node = bvh.nodes[node_idx];
+
+    if (node.is_leaf()) {
+      ++num_leaves;
+      total_leaf_depth += depth;
+      if (leaves_per_depth.size() <= depth)
+        leaves_per_depth.resize(depth + 1);
+      ++leaves_per_depth[depth];
+      if (leaves_per_size.size() <= node.num_primitives)
+        leaves_per_size.resize(node.num_primitives + 1);
+      ++leaves_per_size[node.num_primitives];
+      continue;
+    }
+
+    BoundingBox overlap = bvh.nodes[node.child_index].box;
+    overlap.intersect_with(bvh.nodes[node.child_index + 1].box);
+    if (overlap.min.x < overlap.max.x && overlap.min.y < overlap.max.y &&
+        overlap.min.z < overlap.max.z) {
+      ++num_overlapping_nodes;
+      overlap_area += ratio(overlap.surface_area(), root_area);
+    }
+    stack.push_back({node.child_index + 1, depth + 1});
+    stack.push_back({node.child_index, depth + 1});
+  }
+  mean_leaf_depth = ratio(total_leaf_depth, num_leaves);
+}
+
+std::string BVHStats::report() const {
+  const size_t num_inner_nodes = num_nodes - num_leaves;
+  std::string result = fmt::format(
+      "BVH: {} nodes ({} leaves) over {} primitives, SAH cost {:.2f}\n",
+      num_nodes, num_leaves, num_primitives, sah_cost);
+  result += fmt::format("  Leaf depth: mean {:.2f}, max {}\n",
+                        mean_leaf_depth, leaves_per_depth.size() - 1);
+  result += fmt::format("  Leaves by depth: {}\n", histogram(leaves_per_depth));
+  result += fmt::format("  Leaves by size: {}\n", histogram(leaves_per_size));
+  result += fmt::format("  Overlapping children: {:.1f}% of inner nodes, "
+                        "overlap area {:.2f} of the root's\n",
+                        100.0 * ratio(num_overlapping_nodes, num_inner_nodes),
+                        overlap_area);
+  result += fmt::format("  Memory: {:.2f} MiB of nodes, {:.2f} MiB of "
+                        "primitive pointers, {:.2f} MiB of packed primitives",
+                        node_bytes / 1048576.0,
+                        primitive_pointer_bytes / 1048576.0,
+                        packed_primitive_bytes / 1048576.0);
+  return result;
+}
+
+std::string BVHStats::json() const {
+  return fmt::format(
+      "{{\"nodes\": {}, \"leaves\": {}, \"primitives\": {}, "
+      "\"sah_cost\": {}, \"mean_leaf_depth\": {}, \"leaves_per_depth\": {}, "
+      "\"leaves_per_size\": {}, \"overlapping_nodes\": {}, "
+      "\"overlap_area\": {}, \"node_bytes\": {}, "
+      "\"primitive_pointer_bytes\": {}, \"packed_primitive_bytes\": {}}}",
+      num_nodes, num_leaves, num_primitives, sah_cost, mean_leaf_depth,
+      json_array(leaves_per_depth), json_array(leaves_per_size),
+      num_overlapping_nodes, overlap_area, node_bytes,
+      primitive_pointer_bytes, packed_primitive_bytes);
+}
+
+void TraversalStats::add_to_thread(const TraversalStats &counts) {
+  thread_total.stats += counts;
+}
+
+TraversalStats TraversalStats::total() {
+  std::lock_guard lock(exited_threads_mutex);
+  TraversalStats result = exited_threads_total;
+  return result += thread_total.stats;
+}
+
+void TraversalStats::reset() {
+  std::lock_guard lock(exited_threads_mutex);
+  exited_threads_total = TraversalStats();
+  thread_total.stats = TraversalStats();
+}
+
+std::string TraversalStats::report() const {
+  return fmt::format("{} rays, per ray {:.2f} nodes visited, "
+                     "{:.2f} box tests, {:.2f} primitive tests",
+                     num_rays, ratio(nodes_visited, num_rays),
+                     ratio(box_tests, num_rays),
+                     ratio(primitive_tests, num_rays));
+}
+
+std::string TraversalStats::json() const {
+  return fmt::format(
+      "{{\"rays\": {}, \"nodes_visited\": {}, \"box_tests\": {}, "
+      "\"primitive_tests\": {}, \"nodes_visited_per_ray\": {}, "
+      "\"box_tests_per_ray\": {}, \"primitive_tests_per_ray\": {}}}",
+      num_rays, nodes_visited, box_tests, primitive_tests,
+      ratio(nodes_visited, num_rays), ratio(box_tests, num_rays),
+      ratio(primitive_tests, num_rays));
+}
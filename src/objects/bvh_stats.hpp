@@ -0,0 +1,93 @@
+#pragma once
+
+#include "util/util.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Whether BVH traversal kernels count the work they do per ray. Off unless the
+// SPECTRAL_TRAVERSAL_STATS CMake option is on; otherwise the counters compile
+// away entirely.
+#ifndef SPECTRAL_TRAVERSAL_STATS
+#define SPECTRAL_TRAVERSAL_STATS 0
+#endif
+
+struct BVHFlatTree;
+
+// Shape and quality of a built BVHFlatTree, for telling a bad tree apart from
+// a scene that is simply expensive
+struct BVHStats {
+  size_t num_nodes = 0, num_leaves = 0, num_primitives = 0;
+  real sah_cost = 0.0;
+  // Entry d counts the leaves at depth d, with the root at depth 1
+  std::vector<size_t> leaves_per_depth;
+  real mean_leaf_depth = 0.0;
+  // Entry n counts the leaves holding n primitives
+  std::vector<size_t> leaves_per_size;
+  // Inner nodes whose children's boxes overlap, and the surface area of those
+  // overlaps relative to the root's: the expected number of overlaps a ray
+  // through the root passes through
+  size_t num_overlapping_nodes = 0;
+  real overlap_area = 0.0;
+  // The node, primitive pointer and packed primitive arrays; the primitives
+  // themselves live elsewhere and may be shared between trees
+  size_t node_bytes = 0, primitive_pointer_bytes = 0,
+         packed_primitive_bytes = 0;
+
+  explicit BVHStats(const BVHFlatTree &bvh);
+
+  std::string report() const;
+  std::string json() const;
+};
+
+// Work done by BVH traversals, summed over rays
+struct TraversalStats {
+  uint64_t num_rays = 0, nodes_visited = 0, box_tests = 0,
+           primitive_tests = 0;
+
+  TraversalStats &operator+=(const TraversalStats &other) {
+    num_rays += other.num_rays;
+    nodes_visited += other.nodes_visited;
+    box_tests += other.box_tests;
+    primitive_tests += other.primitive_tests;
+    return *this;
+  }
+
+  // Adds counts to the calling thread's totals
+  static void add_to_thread(const TraversalStats &counts);
+  // The totals of every thread that has exited since the last reset(), plus
+  // the calling thread's. Threads still running are not included, so call
+  // this once rendering threads have been joined.
+  static TraversalStats total();
+  static void reset();
+
+  std::string report() const;
+  std::string json() const;
+};
+
+// Counts one traversal's work in locals and adds it to the thread's totals
+// when it goes out of scope, so kernels touch thread-local storage once per
+// ray rather than once per node
+struct TraversalCounter {
+#if SPECTRAL_TRAVERSAL_STATS
+  TraversalStats counts;
+
+  explicit TraversalCounter(const uint64_t num_rays = 1) {
+    counts.num_rays = num_rays;
+  }
+  TraversalCounter(const TraversalCounter &) = delete;
+  TraversalCounter &operator=(const TraversalCounter &) = delete;
+  ~TraversalCounter() { TraversalStats::add_to_thread(counts); }
+
+  void visit_nodes(const uint64_t n = 1) { counts.nodes_visited += n; }
+  void test_boxes(const uint64_t n) { counts.box_tests += n; }
+  void test_primitives(const uint64_t n) { counts.primitive_tests += n; }
+#else
+  explicit TraversalCounter(const uint64_t = 1) {}
+
+  void visit_nodes(const uint64_t = 1) {}
+  void test_boxes(const uint64_t) {}
+  void test_primitives(const uint64_t) {}
+#endif
+};
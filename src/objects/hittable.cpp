@@ -0,0 +1,20 @@
+#include "hittable.hpp"
+#include "hit_record.hpp"
+
+bool Hittable::occluded(const Ray &ray, const real t_min,
+                        const real t_max) const {
+  HitRecord record;
+  return hit(ray, t_min, t_max, record);
+}
+
+uint32_t Hittable::hit_packet(const RayPacket<packet_size> &packet,
+                              const real t_min, HitRecord *records) const {
+  uint32_t result = 0;
+  for (size_t lane = 0; lane < packet_size; ++lane) {
+    if (!(packet.active_mask & (1u << lane)))
+      continue;
+    if (hit(packet.rays[lane], t_min, records[lane].t, records[lane]))
+      result |= 1u << lane;
+  }
+  return result;
+}
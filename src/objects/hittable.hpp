@@ -3,6 +3,7 @@
 
 #include "objects/bounding_box.hpp"
 #include "util/ray.hpp"
+#include "util/ray_packet.hpp"
 #include "util/util.hpp"
 
 struct HitRecord;
@@ -12,4 +13,16 @@ public:
   virtual bool hit(const Ray &ray, const real t_min, const real t_max,
                    HitRecord &rec) const = 0;
   virtual BoundingBox bounding_box() const = 0;
+
+  // Any-hit query: whether anything blocks the ray within (t_min, t_max).
+  // Stops at the first intersection found and computes no hit attributes.
+  // By default falls back to a closest-hit query.
+  virtual bool occluded(const Ray &ray, const real t_min,
+                        const real t_max) const;
+
+  // Closest-hit query for every active lane of a packet. Each lane only
+  // accepts hits closer than records[lane].t, and the mask of lanes that hit
+  // something is returned. By default the lanes are traced one at a time.
+  virtual uint32_t hit_packet(const RayPacket<packet_size> &packet,
+                              const real t_min, HitRecord *records) const;
 };
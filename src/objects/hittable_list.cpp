@@ -21,3 +21,20 @@ bool HittableList::hit(const Ray &ray, const real t_min, const real t_max,
 
   return hit_anything;
 }
+
+bool HittableList::occluded(const Ray &ray, const real t_min,
+                            const real t_max) const {
+  for (const auto &object : objects)
+    if (object->bounding_box().hit(ray, t_min, t_max).has_value() &&
+        object->occluded(ray, t_min, t_max))
+      return true;
+  return false;
+}
+
+uint32_t HittableList::hit_packet(const RayPacket<packet_size> &packet,
+                                  const real t_min, HitRecord *records) const {
+  uint32_t result = 0;
+  for (const auto &object : objects)
+    result |= object->hit_packet(packet, t_min, records);
+  return result;
+}
@@ -30,5 +30,10 @@ struct HittableList : public Hittable {
 
   virtual bool hit(const Ray &ray, const real t_min, const real t_max,
                    HitRecord &record) const override;
+  virtual bool occluded(const Ray &ray, const real t_min,
+                        const real t_max) const override;
+  virtual uint32_t hit_packet(const RayPacket<packet_size> &packet,
+                              const real t_min,
+                              HitRecord *records) const override;
   virtual BoundingBox bounding_box() const override { return box; }
 };
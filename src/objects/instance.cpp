@@ -0,0 +1,61 @@
+#include "instance.hpp"
+
+#include "hit_record.hpp"
+
+// The world-space box around all eight corners of the object's box
+static BoundingBox transformed_box(const BoundingBox &box,
+                                   const mat4 &transform) {
+  BoundingBox result;
+  for (int corner = 0; corner < 8; ++corner) {
+    const vec3 point(corner & 1 ? box.max.x : box.min.x,
+                     corner & 2 ? box.max.y : box.min.y,
+                     corner & 4 ? box.max.z : box.min.z);
+    const vec3 transformed = vec3(transform * vec4(point, 1.0));
+    result.union_with(BoundingBox(transformed, transformed));
+  }
+  return result;
+}
+
+Instance::Instance(std::shared_ptr<Hittable> object,
+                   const mat4 &object_to_world)
+    : object(std::move(object)), object_to_world(object_to_world),
+      world_to_object(glm::inverse(object_to_world)),
+      normal_to_world(glm::transpose(glm::inverse(mat3(object_to_world)))),
+      box(transformed_box(this->object->bounding_box(), object_to_world)) {}
+
+std::pair<Ray, real> Instance::to_object(const Ray &ray) const {
+  const vec3 direction = vec3(world_to_object * vec4(ray.direction, 0.0));
+  return {Ray(vec3(world_to_object * vec4(ray.origin, 1.0)), direction,
+              ray.wavelength),
+          glm::length(direction)};
+}
+
+bool Instance::hit(const Ray &ray, const real t_min, const real t_max,
+                   HitRecord &record) const {
+  const auto [object_ray, scale] = to_object(ray);
+
+  // Only a hit closer than the caller's fills in object_record, whatever the
+  // object returns, so anything else must not be copied out of it
+  HitRecord object_record;
+  const real closest_so_far = record.t * scale;
+  object_record.t = closest_so_far;
+  if (!object->hit(object_ray, t_min * scale, t_max * scale, object_record) ||
+      !(object_record.t < closest_so_far))
+    return false;
+
+  // Normals stay on the same side of the ray under the inverse transpose, so
+  // the object's front_face still holds
+  record.t = object_record.t / scale;
+  record.pos = ray.at(record.t);
+  record.uv = object_record.uv;
+  record.normal = glm::normalize(normal_to_world * object_record.normal);
+  record.front_face = object_record.front_face;
+  record.material = object_record.material;
+  return true;
+}
+
+bool Instance::occluded(const Ray &ray, const real t_min,
+                        const real t_max) const {
+  const auto [object_ray, scale] = to_object(ray);
+  return object->occluded(object_ray, t_min * scale, t_max * scale);
+}
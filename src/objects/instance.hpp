@@ -0,0 +1,39 @@
+#pragma once
+
+#include "hittable.hpp"
+
+#include "objects/bounding_box.hpp"
+#include "util/util.hpp"
+
+#include <memory>
+#include <utility>
+
+struct HitRecord;
+
+// A placement of a shared object, usually a bottom-level BVHFlatTree built
+// once per unique mesh, under an affine object-to-world transform. Rays are
+// moved into object space to be traced against the object, and hits are moved
+// back out, so any number of instances share one copy of the geometry.
+// A BVHFlatTree over instances is the top level of a two-level hierarchy.
+struct Instance : public Hittable {
+  const std::shared_ptr<Hittable> object;
+  const mat4 object_to_world, world_to_object;
+  // Inverse transpose of object_to_world's linear part, for normals
+  const mat3 normal_to_world;
+  const BoundingBox box;
+
+  Instance(std::shared_ptr<Hittable> object, const mat4 &object_to_world);
+  virtual ~Instance() {}
+
+  virtual bool hit(const Ray &ray, const real t_min, const real t_max,
+                   HitRecord &record) const override;
+  virtual bool occluded(const Ray &ray, const real t_min,
+                        const real t_max) const override;
+  virtual BoundingBox bounding_box() const override { return box; }
+
+private:
+  // The ray in object space, and how far it travels there per unit of world
+  // distance: object-space rays have unit directions too, so distances along
+  // them are scaled by how much the transform stretches the direction
+  std::pair<Ray, real> to_object(const Ray &ray) const;
+};
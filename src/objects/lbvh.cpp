@@ -0,0 +1,392 @@
+#include "lbvh.hpp"
+
+#include "objects/bvh.hpp"
+#include "util/timer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+
+// Spreads the low 21 bits of v out to every third bit
+static inline uint64_t expand_bits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffff;
+  v = (v | v << 16) & 0x1f0000ff0000ff;
+  v = (v | v << 8) & 0x100f00f00f00f00f;
+  v = (v | v << 4) & 0x10c30c30c30c30c3;
+  v = (v | v << 2) & 0x1249249249249249;
+  return v;
+}
+
+// The SAH cost of a subtree with bounds of surface area `area`: the cheaper of
+// splitting it (split_cost, its children's costs plus traversing the node) and
+// intersecting all of its primitives as one leaf, where that is allowed
+static inline real subtree_cost(const real area, const size_t num_primitives,
+                                const real split_cost) {
+  const real node_cost = area * BVHTree::node_traversal_cost + split_cost;
+  if (num_primitives > LinearBVH::max_leaf_primitives)
+    return node_cost;
+  return std::min(node_cost, area * static_cast<real>(num_primitives));
+}
+
+// Sorts keys and the values alongside them, 8 bits at a time, skipping the
+// digits every key shares
+static void radix_sort(std::vector<uint64_t> &keys,
+                       std::vector<uint32_t> &values) {
+  std::vector<uint64_t> sorted_keys(keys.size());
+  std::vector<uint32_t> sorted_values(values.size());
+  for (int shift = 0; shift < 64; shift += 8) {
+    std::array<size_t, 256> offsets = {};
+    for (const uint64_t key : keys)
+      ++offsets[(key >> shift) & 0xff];
+    if (std::ranges::find(offsets, keys.size()) != offsets.end())
+      continue;
+
+    size_t offset = 0;
+    for (size_t &count : offsets)
+      offset += std::exchange(count, offset);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      const size_t idx = offsets[(keys[i] >> shift) & 0xff]++;
+      sorted_keys[idx] = keys[i];
+      sorted_values[idx] = values[i];
+    }
+    keys.swap(sorted_keys);
+    values.swap(sorted_values);
+  }
+}
+
+LinearBVH::LinearBVH(const std::vector<std::shared_ptr<Hittable>> &primitives,
+                     const size_t treelet_passes, const size_t num_threads) {
+  debug_assert(!primitives.empty(), "Can't build a BVH over no primitives");
+  debug_assert(primitives.size() < (size_t(1) << 31),
+               "Too many primitives for 32-bit node indices");
+  // Sized only now: with no primitives, 2n - 1 wraps around
+  nodes.resize(2 * primitives.size() - 1);
+  Timer timer;
+  const size_t num_primitives = primitives.size();
+  const size_t chunks = std::clamp<size_t>(
+      num_primitives / BVHTree::min_parallel_primitives, 1, num_threads);
+
+  // 1. Morton codes of the centroids, quantised within the centroid bounds
+  std::vector<BoundingBox> boxes(num_primitives);
+  std::vector<BoundingBox> chunk_centroid_bounds(chunks);
+  for_each_chunk(0, num_primitives, chunks,
+                 [&](const size_t chunk, const size_t chunk_start,
+                     const size_t chunk_end) {
+                   for (size_t i = chunk_start; i < chunk_end; ++i) {
+                     boxes[i] = primitives[i]->bounding_box();
+                     const vec3 centroid =
+                         real(0.5) * (boxes[i].min + boxes[i].max);
+                     chunk_centroid_bounds[chunk].union_with(
+                         BoundingBox(centroid, centroid));
+                   }
+                 });
+  BoundingBox centroid_bounds;
+  for (const BoundingBox &bounds : chunk_centroid_bounds)
+    centroid_bounds.union_with(bounds);
+
+  constexpr real max_quantised = (1 << morton_bits_per_axis) - 1;
+  const vec3 extent = centroid_bounds.max - centroid_bounds.min;
+  vec3 scale;
+  for (int axis = 0; axis < 3; ++axis)
+    scale[axis] = extent[axis] > 0.0 ? max_quantised / extent[axis] : 0.0;
+
+  std::vector<uint64_t> codes(num_primitives);
+  std::vector<uint32_t> order(num_primitives);
+  for_each_chunk(0, num_primitives, chunks,
+                 [&](const size_t, const size_t chunk_start,
+                     const size_t chunk_end) {
+                   for (size_t i = chunk_start; i < chunk_end; ++i) {
+                     const vec3 centroid =
+                         real(0.5) * (boxes[i].min + boxes[i].max);
+                     const vec3 quantised =
+                         (centroid - centroid_bounds.min) * scale;
+                     codes[i] =
+                         expand_bits(static_cast<uint64_t>(quantised.x)) << 2 |
+                         expand_bits(static_cast<uint64_t>(quantised.y)) << 1 |
+                         expand_bits(static_cast<uint64_t>(quantised.z));
+                     order[i] = i;
+                   }
+                 });
+
+  // 2. Sort along the curve
+  radix_sort(codes, order);
+  this->primitives.resize(num_primitives);
+  for (size_t i = 0; i < num_primitives; ++i) {
+    this->primitives[i] = primitives[order[i]];
+    nodes[num_primitives - 1 + i].box = boxes[order[i]];
+  }
+  const real sort_nanoseconds = timer.elapsed_nanoseconds();
+
+  // 3. Place every inner node independently
+  for_each_chunk(0, num_primitives - 1, chunks,
+                 [&](const size_t, const size_t chunk_start,
+                     const size_t chunk_end) {
+                   for (size_t i = chunk_start; i < chunk_end; ++i)
+                     place_inner_node(codes, i);
+                 });
+  compute_bounds(root);
+  const real hierarchy_nanoseconds =
+      timer.elapsed_nanoseconds() - sort_nanoseconds;
+
+  // 4. Reshape treelets bottom-up, so each one is built from optimised
+  // subtrees. Reshaping only moves inner nodes around below the treelet root,
+  // so a post-order taken before the pass stays valid throughout it. Small
+  // subtrees gain little from another pass, so each pass only roots treelets
+  // at subtrees twice as large as the last.
+  std::vector<uint32_t> post_order;
+  for (size_t pass = 0; pass < treelet_passes; ++pass) {
+    const size_t min_primitives = treelet_size << pass;
+    post_order.clear();
+    std::vector<std::pair<uint32_t, bool>> stack = {{root, false}};
+    while (!stack.empty()) {
+      const auto [node_idx, children_visited] = stack.back();
+      stack.pop_back();
+      if (is_leaf(node_idx) || nodes[node_idx].num_primitives < min_primitives)
+        continue;
+      if (children_visited) {
+        post_order.push_back(node_idx);
+        continue;
+      }
+      stack.emplace_back(node_idx, true);
+      for (const uint32_t child : nodes[node_idx].children)
+        stack.emplace_back(child, false);
+    }
+    for (const uint32_t node_idx : post_order)
+      restructure_treelet(node_idx);
+  }
+  const real treelet_nanoseconds =
+      timer.elapsed_nanoseconds() - hierarchy_nanoseconds - sort_nanoseconds;
+
+  fmt::println("Built linear BVH on {} primitives in {:.3f} ns (sort {:.3f} "
+               "ns, hierarchy {:.3f} ns, {} treelet passes {:.3f} ns)",
+               num_primitives, timer.elapsed_nanoseconds(), sort_nanoseconds,
+               hierarchy_nanoseconds, treelet_passes, treelet_nanoseconds);
+}
+
+void LinearBVH::place_inner_node(const std::vector<uint64_t> &codes,
+                                 const int64_t node_idx) {
+  const int64_t num_primitives = codes.size();
+  // Length of the common prefix of the codes at i and j, counting equal codes
+  // as differing in their indices; -1 outside the array
+  const auto prefix = [&](const int64_t i, const int64_t j) -> int {
+    if (j < 0 || j >= num_primitives)
+      return -1;
+    if (codes[i] == codes[j])
+      return 64 + std::countl_zero(static_cast<uint64_t>(i ^ j));
+    return std::countl_zero(codes[i] ^ codes[j]);
+  };
+
+  // The node covers a range with one end at node_idx, extending towards the
+  // neighbour that shares the longer prefix
+  const int64_t direction =
+      prefix(node_idx, node_idx + 1) > prefix(node_idx, node_idx - 1) ? 1 : -1;
+  const int min_prefix = prefix(node_idx, node_idx - direction);
+  int64_t max_length = 2;
+  while (prefix(node_idx, node_idx + max_length * direction) > min_prefix)
+    max_length *= 2;
+  int64_t length = 0;
+  for (int64_t step = max_length / 2; step > 0; step /= 2)
+    if (prefix(node_idx, node_idx + (length + step) * direction) > min_prefix)
+      length += step;
+  const int64_t other_end = node_idx + length * direction;
+
+  // Split where the range's common prefix ends
+  const int node_prefix = prefix(node_idx, other_end);
+  int64_t split = 0;
+  for (int64_t step = length;;) {
+    step = (step + 1) / 2;
+    if (prefix(node_idx, node_idx + (split + step) * direction) > node_prefix)
+      split += step;
+    if (step == 1)
+      break;
+  }
+  const int64_t left =
+      node_idx + split * direction + std::min<int64_t>(direction, 0);
+
+  const int64_t first_leaf = num_primitives - 1;
+  nodes[node_idx].children = {
+      static_cast<uint32_t>(std::min(node_idx, other_end) == left
+                                ? first_leaf + left
+                                : left),
+      static_cast<uint32_t>(std::max(node_idx, other_end) == left + 1
+                                ? first_leaf + left + 1
+                                : left + 1)};
+}
+
+void LinearBVH::compute_bounds(const uint32_t node_idx) {
+  Node &node = nodes[node_idx];
+  if (is_leaf(node_idx)) {
+    node.num_primitives = 1;
+    node.cost = node.box.surface_area();
+    return;
+  }
+
+  const auto [left, right] = node.children;
+  compute_bounds(left);
+  compute_bounds(right);
+  node.box = BoundingBox::box_union(nodes[left].box, nodes[right].box);
+  node.num_primitives =
+      nodes[left].num_primitives + nodes[right].num_primitives;
+  node.cost = subtree_cost(node.box.surface_area(), node.num_primitives,
+                           nodes[left].cost + nodes[right].cost);
+}
+
+bool LinearBVH::collapses(const uint32_t node_idx) const {
+  const Node &node = nodes[node_idx];
+  return !is_leaf(node_idx) && node.num_primitives <= max_leaf_primitives &&
+         node.box.surface_area() * node.num_primitives <= node.cost;
+}
+
+void LinearBVH::restructure_treelet(const uint32_t node_idx) {
+  // Grow the treelet by opening its largest leaf until it has treelet_size
+  // leaves; the inner nodes it opened are free to be rearranged
+  std::array<uint32_t, treelet_size> leaves;
+  std::array<uint32_t, treelet_size - 1> inner;
+  size_t num_leaves = 0, num_inner = 0;
+  inner[num_inner++] = node_idx;
+  leaves[num_leaves++] = nodes[node_idx].children[0];
+  leaves[num_leaves++] = nodes[node_idx].children[1];
+  while (num_leaves < treelet_size) {
+    size_t best_leaf = treelet_size;
+    real best_area = -INFINITY;
+    for (size_t i = 0; i < num_leaves; ++i) {
+      const real area = nodes[leaves[i]].box.surface_area();
+      if (!is_leaf(leaves[i]) && area > best_area) {
+        best_leaf = i;
+        best_area = area;
+      }
+    }
+    if (best_leaf == treelet_size)
+      break;
+    const uint32_t opened = leaves[best_leaf];
+    inner[num_inner++] = opened;
+    leaves[best_leaf] = nodes[opened].children[0];
+    leaves[num_leaves++] = nodes[opened].children[1];
+  }
+  if (num_leaves < 3)
+    return;
+
+  // Cheapest binary tree over every subset of the leaves, smallest first
+  constexpr size_t num_subsets = size_t(1) << treelet_size;
+  std::array<BoundingBox, num_subsets> subset_box;
+  std::array<real, num_subsets> subset_cost;
+  std::array<uint32_t, num_subsets> subset_primitives, subset_split;
+  const uint32_t all_leaves = (1u << num_leaves) - 1;
+  for (uint32_t subset = 1; subset <= all_leaves; ++subset) {
+    if (std::has_single_bit(subset)) {
+      const Node &leaf = nodes[leaves[std::countr_zero(subset)]];
+      subset_box[subset] = leaf.box;
+      subset_cost[subset] = leaf.cost;
+      subset_primitives[subset] = leaf.num_primitives;
+      continue;
+    }
+
+    // Each split is only tried once, with the lowest leaf on the left
+    const uint32_t lowest = subset & -subset;
+    real best_cost = INFINITY;
+    for (uint32_t left = (subset - 1) & subset; left > 0;
+         left = (left - 1) & subset) {
+      if (!(left & lowest))
+        continue;
+      const real cost = subset_cost[left] + subset_cost[subset ^ left];
+      if (cost < best_cost) {
+        best_cost = cost;
+        subset_split[subset] = left;
+      }
+    }
+    const uint32_t left = subset_split[subset];
+    subset_box[subset] =
+        BoundingBox::box_union(subset_box[left], subset_box[subset ^ left]);
+    subset_primitives[subset] =
+        subset_primitives[left] + subset_primitives[subset ^ left];
+    subset_cost[subset] =
+        subtree_cost(subset_box[subset].surface_area(),
+                     subset_primitives[subset], best_cost);
+  }
+  // Keep the treelet unless the new one is clearly better, so rounding never
+  // causes churn
+  if (!(subset_cost[all_leaves] < nodes[node_idx].cost * (1.0 - 1e-9)))
+    return;
+
+  // Rebuild it, reusing the inner nodes; node_idx stays the root
+  size_t next_inner = 1;
+  const std::function<uint32_t(uint32_t, uint32_t)> rebuild =
+      [&](const uint32_t subset, const uint32_t inner_idx) {
+        if (std::has_single_bit(subset))
+          return leaves[std::countr_zero(subset)];
+        const uint32_t left = subset_split[subset];
+        Node &node = nodes[inner_idx];
+        node.box = subset_box[subset];
+        node.num_primitives = subset_primitives[subset];
+        node.cost = subset_cost[subset];
+        for (const auto &[child, child_subset] :
+             {std::make_pair(0, left), std::make_pair(1, subset ^ left)}) {
+          const uint32_t child_idx = std::has_single_bit(child_subset)
+                                         ? 0
+                                         : inner[next_inner++];
+          node.children[child] = rebuild(child_subset, child_idx);
+        }
+        return inner_idx;
+      };
+  rebuild(all_leaves, node_idx);
+  debug_assert_eq(next_inner, num_inner, "Treelet lost inner nodes");
+}
+
+BVHFlatTree::BVHFlatTree(const LinearBVH &lbvh) {
+  Timer timer;
+  nodes.reserve(lbvh.nodes.size());
+  primitives.reserve(lbvh.primitives.size());
+
+  // Depth-first, writing each node into the slot its parent reserved. Inner
+  // nodes take the axis their children's centres are furthest apart on, with
+  // the lower child on the left, so traversal can order them by ray direction.
+  const std::function<void(uint32_t, size_t)> flatten = [&](
+      const uint32_t node_idx, const size_t flat_idx) {
+    const LinearBVH::Node &node = lbvh.nodes[node_idx];
+    if (lbvh.is_leaf(node_idx) || lbvh.collapses(node_idx)) {
+      const size_t primitive_idx = primitives.size();
+      std::vector<uint32_t> stack = {node_idx};
+      while (!stack.empty()) {
+        const uint32_t idx = stack.back();
+        stack.pop_back();
+        if (lbvh.is_leaf(idx)) {
+          primitives.push_back(lbvh.primitives[lbvh.leaf_primitive(idx)]);
+        } else {
+          stack.push_back(lbvh.nodes[idx].children[1]);
+          stack.push_back(lbvh.nodes[idx].children[0]);
+        }
+      }
+      nodes[flat_idx] =
+          BVHNode(node.box, 3, primitive_idx, node.num_primitives);
+      return;
+    }
+
+    auto [left, right] = node.children;
+    const BoundingBox &left_box = lbvh.nodes[left].box;
+    const BoundingBox &right_box = lbvh.nodes[right].box;
+    const vec3 offset =
+        (right_box.min + right_box.max) - (left_box.min + left_box.max);
+    uint8_t axis = 0;
+    for (uint8_t a = 1; a < 3; ++a)
+      if (std::abs(offset[a]) > std::abs(offset[axis]))
+        axis = a;
+    if (offset[axis] < 0.0)
+      std::swap(left, right);
+
+    const size_t child_idx = nodes.size();
+    nodes[flat_idx] = BVHNode(node.box, axis, child_idx, 0);
+    nodes.resize(child_idx + 2);
+    flatten(left, child_idx);
+    flatten(right, child_idx + 1);
+  };
+  nodes.resize(1);
+  flatten(lbvh.root, 0);
+  pack_primitives();
+  depth = compute_depth(0);
+  built_sah_cost = sah_cost();
+
+  fmt::println("Flattened linear BVH on {} primitives into {} nodes in {:.3f} "
+               "ns",
+               primitives.size(), nodes.size(), timer.elapsed_nanoseconds());
+}
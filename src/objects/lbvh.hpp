@@ -0,0 +1,61 @@
+#pragma once
+
+#include "objects/bounding_box.hpp"
+#include "objects/hittable.hpp"
+
+#include <array>
+#include <vector>
+
+// A linear BVH (Karras 2012). Primitives are sorted along a Morton curve
+// through their centroids, and the binary radix tree over the sorted codes is
+// the hierarchy: every inner node can be placed without looking at any other,
+// so building takes a radix sort and one pass over the nodes instead of SAH
+// sweeps. The tree is worse than a SAH build; treelet restructuring (Karras
+// and Aila 2013) wins back most of the difference.
+//
+// Flatten it with BVHFlatTree(const LinearBVH &) to trace rays through it.
+struct LinearBVH {
+  struct Node {
+    BoundingBox box;
+    std::array<uint32_t, 2> children = {}; // Inner nodes only
+    uint32_t num_primitives = 1;           // In the subtree
+    // SAH cost of the subtree, not normalised by any surface area
+    real cost = 0.0;
+  };
+
+  // Centroids are quantised to this many bits per axis, giving 63-bit codes.
+  // Primitives sharing a code are split by their index along the curve.
+  static constexpr size_t morton_bits_per_axis = 21;
+  // Treelets are grown to this many leaves, and reshaped into the best binary
+  // tree over them
+  static constexpr size_t treelet_size = 7;
+  // Subtrees of at most this many primitives become a single leaf, if the
+  // SAH prefers that to splitting them
+  static constexpr size_t max_leaf_primitives = 8;
+
+  // Sorted along the curve
+  std::vector<std::shared_ptr<Hittable>> primitives;
+  // The primitives.size() - 1 inner nodes, then one leaf per primitive
+  std::vector<Node> nodes;
+  uint32_t root = 0;
+
+  LinearBVH(const std::vector<std::shared_ptr<Hittable>> &primitives,
+            const size_t treelet_passes = 0,
+            const size_t num_threads = default_num_threads());
+
+  bool is_leaf(const uint32_t node_idx) const {
+    return node_idx + 1 >= primitives.size();
+  }
+  // The primitive a leaf holds
+  uint32_t leaf_primitive(const uint32_t node_idx) const {
+    return node_idx + 1 - primitives.size();
+  }
+  // Whether the subtree is cheaper to intersect as one leaf than to split
+  bool collapses(const uint32_t node_idx) const;
+
+private:
+  void place_inner_node(const std::vector<uint64_t> &codes,
+                        const int64_t node_idx);
+  void compute_bounds(const uint32_t node_idx);
+  void restructure_treelet(const uint32_t node_idx);
+};
@@ -0,0 +1,391 @@
+#include "sbvh.hpp"
+
+#include "objects/triangle.hpp"
+#include "util/timer.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+
+// The SAH cost of splitting a node with surface area bounds_area, relative to
+// the cost of intersecting one primitive
+real split_cost(const real left_count, const real left_area,
+                const real right_count, const real right_area,
+                const real bounds_area) {
+  return BVHTree::node_traversal_cost +
+         (left_count * left_area + right_count * right_area) / bounds_area;
+}
+
+bool is_empty(const BoundingBox &box) {
+  return box.min.x > box.max.x || box.min.y > box.max.y ||
+         box.min.z > box.max.z;
+}
+
+// The bin position falls in, for bins starting at bin_min, bin_scale to a unit
+size_t bin_index(const real position, const real bin_min,
+                 const real bin_scale) {
+  const real bin = (position - bin_min) * bin_scale;
+  return static_cast<size_t>(
+      std::clamp<real>(bin, 0.0, SpatialSplitBVH::num_bins - 1));
+}
+
+} // namespace
+
+SpatialSplitBVH::SpatialSplitBVH(
+    const std::vector<std::shared_ptr<Hittable>> &primitives,
+    const real max_duplication)
+    : primitives(primitives), triangles(primitives.size()) {
+  debug_assert(!primitives.empty(), "Can't build a BVH over no primitives");
+  debug_assert(primitives.size() < (size_t(1) << 31),
+               "Too many primitives for 32-bit node indices");
+  Timer timer;
+  std::vector<Reference> references(primitives.size());
+  for (size_t i = 0; i < primitives.size(); ++i) {
+    triangles[i] = dynamic_cast<const Triangle *>(primitives[i].get());
+    references[i] = {primitives[i]->bounding_box(), static_cast<uint32_t>(i)};
+    root_bounds.union_with(references[i].box);
+  }
+  root = construct(std::move(references), 1,
+                   std::max<real>(max_duplication, 1.0) * primitives.size());
+  num_references = root->subtree_primitives;
+
+  fmt::println("Built spatial split BVH on {} primitives with {} references "
+               "({:.2f} per primitive, {} spatial splits) in {:.3f} ns",
+               primitives.size(), num_references, duplication(),
+               num_spatial_splits, timer.elapsed_nanoseconds());
+}
+
+std::shared_ptr<BVHTree::BVHTreeNode>
+SpatialSplitBVH::construct(std::vector<Reference> references,
+                           const size_t depth, const real max_references) {
+  const size_t count = references.size();
+  BoundingBox bounds;
+  for (const Reference &reference : references)
+    bounds.union_with(reference.box);
+
+  // Spatial splits are only worth their duplicates where the best object
+  // split leaves the children overlapping
+  Split split = object_split(references, bounds);
+  if (count > 1 && depth <= max_spatial_split_depth) {
+    BoundingBox overlap = split.left_box;
+    overlap.intersect_with(split.right_box);
+    if (split.cost == INFINITY ||
+        (!is_empty(overlap) && overlap.surface_area() >=
+                                   min_overlap * root_bounds.surface_area())) {
+      const Split spatial = spatial_split(references, bounds);
+      if (spatial.cost < split.cost &&
+          spatial.left_count + spatial.right_count <= max_references)
+        split = spatial;
+    }
+  }
+
+  const size_t max_primitives = (1 << 16) - 1;
+  const real leaf_cost = count;
+  if (count == 1 || (leaf_cost <= split.cost && count <= max_primitives)) {
+    std::vector<std::shared_ptr<Hittable>> leaf_primitives;
+    for (const Reference &reference : references)
+      leaf_primitives.push_back(primitives[reference.index]);
+    return std::make_shared<BVHTree::BVHTreeNode>(leaf_primitives, bounds);
+  }
+
+  std::vector<Reference> left, right;
+  if (split.spatial) {
+    partition_spatial(references, split, left, right);
+    // Unsplitting can leave one side empty; split by object instead then
+    if (left.empty() || right.empty()) {
+      left.clear();
+      right.clear();
+      split = object_split(references, bounds);
+    } else {
+      ++num_spatial_splits;
+    }
+  }
+  if (!split.spatial && split.cost != INFINITY) {
+    const int axis = split.axis;
+    for (const Reference &reference : references) {
+      const real centroid =
+          0.5 * (reference.box.min[axis] + reference.box.max[axis]);
+      if (bin_index(centroid, split.bin_min, split.bin_scale) < split.bin)
+        left.push_back(reference);
+      else
+        right.push_back(reference);
+    }
+  } else if (!split.spatial) {
+    // Every centroid coincides, so no plane separates the references
+    left.assign(references.begin(), references.begin() + count / 2);
+    right.assign(references.begin() + count / 2, references.end());
+  }
+  references.clear();
+  references.shrink_to_fit();
+
+  const real left_share =
+      static_cast<real>(left.size()) / (left.size() + right.size());
+  const real left_budget =
+      std::max<real>(left_share * max_references, left.size());
+  const real right_budget =
+      std::max<real>(max_references - left_budget, right.size());
+  const auto left_node =
+      construct(std::move(left), depth + 1, left_budget);
+  const auto right_node =
+      construct(std::move(right), depth + 1, right_budget);
+  return std::make_shared<BVHTree::BVHTreeNode>(left_node, right_node,
+                                                split.axis);
+}
+
+SpatialSplitBVH::Split
+SpatialSplitBVH::object_split(const std::vector<Reference> &references,
+                              const BoundingBox &bounds) const {
+  struct Bin {
+    BoundingBox box;
+    size_t count = 0;
+  };
+
+  BoundingBox centroid_bounds;
+  for (const Reference &reference : references) {
+    const vec3 centroid = real(0.5) * (reference.box.min + reference.box.max);
+    centroid_bounds.union_with(BoundingBox(centroid, centroid));
+  }
+  const vec3 extent = centroid_bounds.max - centroid_bounds.min;
+  const real bounds_area = bounds.surface_area();
+
+  Split best;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!(extent[axis] > 0.0))
+      continue;
+    const real bin_min = centroid_bounds.min[axis];
+    const real bin_scale = num_bins / extent[axis];
+    std::array<Bin, num_bins> bins;
+    for (const Reference &reference : references) {
+      const real centroid =
+          0.5 * (reference.box.min[axis] + reference.box.max[axis]);
+      Bin &bin = bins[bin_index(centroid, bin_min, bin_scale)];
+      bin.box.union_with(reference.box);
+      ++bin.count;
+    }
+
+    // suffix_boxes[b] and suffix_counts[b] describe bins [b, num_bins)
+    std::array<BoundingBox, num_bins> suffix_boxes;
+    std::array<size_t, num_bins> suffix_counts;
+    BoundingBox suffix_box;
+    size_t suffix_count = 0;
+    for (size_t b = num_bins - 1; b > 0; --b) {
+      suffix_box.union_with(bins[b].box);
+      suffix_count += bins[b].count;
+      suffix_boxes[b] = suffix_box;
+      suffix_counts[b] = suffix_count;
+    }
+
+    BoundingBox prefix_box;
+    size_t prefix_count = 0;
+    for (size_t b = 1; b < num_bins; ++b) {
+      prefix_box.union_with(bins[b - 1].box);
+      prefix_count += bins[b - 1].count;
+      if (prefix_count == 0 || suffix_counts[b] == 0)
+        continue;
+      const real cost = split_cost(
+          prefix_count, prefix_box.surface_area(), suffix_counts[b],
+          suffix_boxes[b].surface_area(), bounds_area);
+      if (cost < best.cost)
+        best = {.axis = axis,
+                .cost = cost,
+                .bin = b,
+                .spatial = false,
+                .left_box = prefix_box,
+                .right_box = suffix_boxes[b],
+                .left_count = prefix_count,
+                .right_count = suffix_counts[b],
+                .bin_min = bin_min,
+                .bin_scale = bin_scale};
+    }
+  }
+  return best;
+}
+
+SpatialSplitBVH::Split
+SpatialSplitBVH::spatial_split(const std::vector<Reference> &references,
+                               const BoundingBox &bounds) const {
+  // Each reference enters the bin its lower bound is in and exits the one its
+  // upper bound is in, and its clipped part in every bin between grows it
+  struct Bin {
+    BoundingBox box;
+    size_t entries = 0, exits = 0;
+  };
+
+  const vec3 extent = bounds.max - bounds.min;
+  const real bounds_area = bounds.surface_area();
+
+  Split best;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!(extent[axis] > 0.0))
+      continue;
+    const real bin_min = bounds.min[axis];
+    const real bin_scale = num_bins / extent[axis];
+    std::array<Bin, num_bins> bins;
+    for (const Reference &reference : references) {
+      const size_t first =
+          bin_index(reference.box.min[axis], bin_min, bin_scale);
+      const size_t last =
+          bin_index(reference.box.max[axis], bin_min, bin_scale);
+      Reference rest = reference;
+      for (size_t b = first; b < last; ++b) {
+        const auto [lower, upper] =
+            clip(rest, axis, bin_min + (b + 1) / bin_scale);
+        bins[b].box.union_with(lower);
+        rest.box = upper;
+      }
+      bins[last].box.union_with(rest.box);
+      ++bins[first].entries;
+      ++bins[last].exits;
+    }
+
+    std::array<BoundingBox, num_bins> suffix_boxes;
+    std::array<size_t, num_bins> suffix_counts;
+    BoundingBox suffix_box;
+    size_t suffix_count = 0;
+    for (size_t b = num_bins - 1; b > 0; --b) {
+      suffix_box.union_with(bins[b].box);
+      suffix_count += bins[b].exits;
+      suffix_boxes[b] = suffix_box;
+      suffix_counts[b] = suffix_count;
+    }
+
+    BoundingBox prefix_box;
+    size_t prefix_count = 0;
+    for (size_t b = 1; b < num_bins; ++b) {
+      prefix_box.union_with(bins[b - 1].box);
+      prefix_count += bins[b - 1].entries;
+      if (prefix_count == 0 || suffix_counts[b] == 0 ||
+          is_empty(prefix_box) || is_empty(suffix_boxes[b]))
+        continue;
+      const real cost = split_cost(
+          prefix_count, prefix_box.surface_area(), suffix_counts[b],
+          suffix_boxes[b].surface_area(), bounds_area);
+      if (cost < best.cost)
+        best = {.axis = axis,
+                .cost = cost,
+                .bin = b,
+                .spatial = true,
+                .left_box = prefix_box,
+                .right_box = suffix_boxes[b],
+                .left_count = prefix_count,
+                .right_count = suffix_counts[b],
+                .bin_min = bin_min,
+                .bin_scale = bin_scale};
+    }
+  }
+  return best;
+}
+
+void SpatialSplitBVH::partition_spatial(
+    const std::vector<Reference> &references, const Split &split,
+    std::vector<Reference> &left, std::vector<Reference> &right) const {
+  const int axis = split.axis;
+  const real position = split.bin_min + split.bin / split.bin_scale;
+  BoundingBox left_box = split.left_box, right_box = split.right_box;
+  size_t left_count = split.left_count, right_count = split.right_count;
+
+  for (const Reference &reference : references) {
+    const size_t first =
+        bin_index(reference.box.min[axis], split.bin_min, split.bin_scale);
+    const size_t last =
+        bin_index(reference.box.max[axis], split.bin_min, split.bin_scale);
+    if (last < split.bin) {
+      left.push_back(reference);
+      continue;
+    }
+    if (first >= split.bin) {
+      right.push_back(reference);
+      continue;
+    }
+
+    // Keep the reference whole on one side if that is cheaper than having
+    // it on both
+    BoundingBox left_union = left_box, right_union = right_box;
+    left_union.union_with(reference.box);
+    right_union.union_with(reference.box);
+    const real split_cost = left_box.surface_area() * left_count +
+                            right_box.surface_area() * right_count;
+    const real left_cost = left_union.surface_area() * left_count +
+                           right_box.surface_area() * (right_count - 1);
+    const real right_cost = left_box.surface_area() * (left_count - 1) +
+                            right_union.surface_area() * right_count;
+    if (left_cost < split_cost && left_cost <= right_cost) {
+      left.push_back(reference);
+      left_box = left_union;
+      --right_count;
+    } else if (right_cost < split_cost) {
+      right.push_back(reference);
+      right_box = right_union;
+      --left_count;
+    } else {
+      const auto [lower, upper] = clip(reference, axis, position);
+      if (!is_empty(lower))
+        left.push_back({lower, reference.index});
+      if (!is_empty(upper))
+        right.push_back({upper, reference.index});
+    }
+  }
+}
+
+std::pair<BoundingBox, BoundingBox>
+SpatialSplitBVH::clip(const Reference &reference, const int axis,
+                      const real position) const {
+  BoundingBox lower, upper;
+  if (const Triangle *triangle = triangles[reference.index]) {
+    // The vertices on each side, and where the edges cross the plane
+    const std::array<vec3, 3> vertices = {triangle->a, triangle->b,
+                                          triangle->c};
+    for (size_t i = 0; i < 3; ++i) {
+      const vec3 &p = vertices[i], &q = vertices[(i + 1) % 3];
+      if (p[axis] <= position)
+        lower.union_with(BoundingBox(p, p));
+      if (p[axis] >= position)
+        upper.union_with(BoundingBox(p, p));
+      if ((p[axis] < position && position < q[axis]) ||
+          (q[axis] < position && position < p[axis])) {
+        const real t = (position - p[axis]) / (q[axis] - p[axis]);
+        vec3 crossing = p + t * (q - p);
+        crossing[axis] = position;
+        lower.union_with(BoundingBox(crossing, crossing));
+        upper.union_with(BoundingBox(crossing, crossing));
+      }
+    }
+  } else {
+    lower = upper = reference.box;
+    lower.max[axis] = std::min(lower.max[axis], position);
+    upper.min[axis] = std::max(upper.min[axis], position);
+  }
+  // The reference may already have been clipped by an ancestor
+  lower.intersect_with(reference.box);
+  upper.intersect_with(reference.box);
+  return {lower, upper};
+}
+
+BVHFlatTree::BVHFlatTree(const SpatialSplitBVH &sbvh) {
+  Timer timer;
+  nodes.resize(sbvh.root->subtree_nodes);
+  primitives.resize(sbvh.root->subtree_primitives);
+  construct(sbvh.root, 0, 1, 0);
+  pack_primitives();
+  depth = compute_depth(0);
+  built_sah_cost = sah_cost();
+  builder = BVHBuilder::SpatialSplit;
+  unique_primitives = sbvh.primitives;
+
+  fmt::println("Flattened spatial split BVH with {} references into {} nodes "
+               "in {:.3f} ns",
+               primitives.size(), nodes.size(), timer.elapsed_nanoseconds());
+}
+
+std::shared_ptr<BVHFlatTree>
+build_bvh(const std::vector<std::shared_ptr<Hittable>> &primitives,
+          const BVHBuilder builder, const size_t num_threads) {
+  switch (builder) {
+  case BVHBuilder::SpatialSplit:
+    return std::make_shared<BVHFlatTree>(SpatialSplitBVH(primitives));
+  case BVHBuilder::SAH:
+    break;
+  }
+  return std::make_shared<BVHFlatTree>(primitives, num_threads);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "objects/bvh.hpp"
+
+#include <vector>
+
+struct Triangle;
+
+// A spatial split BVH (Stich, Friedrich and Dietrich 2009). Alongside the
+// usual object splits, nodes whose children would overlap also try splitting
+// space itself at bin planes: references straddling the plane are clipped to
+// either side and go into both children, so long, thin or large triangles no
+// longer inflate every node they pass through. Triangles are clipped exactly;
+// other primitives only have their boxes cut at the plane.
+//
+// Duplicated references cost memory, so the tree may hold at most
+// max_duplication references per primitive. Every node shares its budget out
+// between its children by their reference counts, so the duplicates go where
+// spatial splits pay off rather than to whichever subtree is built first.
+// Building is single threaded, and the tree only depends on the primitives.
+//
+// Flatten it with BVHFlatTree(const SpatialSplitBVH &) to trace rays through
+// it. Leaf primitives may then appear in more than one leaf.
+struct SpatialSplitBVH {
+  // A primitive, or the part of it within box
+  struct Reference {
+    BoundingBox box;
+    uint32_t index; // Into primitives
+  };
+
+  static constexpr size_t num_bins = BVHTree::num_bins;
+  // Spatial splits are only tried where an object split's children overlap by
+  // at least this much of the root's surface area
+  static constexpr real min_overlap = 1e-5;
+  static constexpr real default_max_duplication = 1.5;
+  // Deeper nodes only try object splits, which always shrink their children,
+  // so duplication can't keep a branch growing forever. Object splits can
+  // still take the tree past BVHFlatTree::max_stack_depth, and such trees
+  // are traced recursively.
+  static constexpr size_t max_spatial_split_depth = 48;
+
+  std::vector<std::shared_ptr<Hittable>> primitives;
+  std::shared_ptr<BVHTree::BVHTreeNode> root;
+  size_t num_references = 0, num_spatial_splits = 0;
+
+  SpatialSplitBVH(const std::vector<std::shared_ptr<Hittable>> &primitives,
+                  const real max_duplication = default_max_duplication);
+
+  // References per primitive in the finished tree
+  real duplication() const {
+    return static_cast<real>(num_references) / primitives.size();
+  }
+
+private:
+  struct Split {
+    int axis = 0;
+    real cost = INFINITY;
+    // Object splits send references whose centroid is in a bin below bin to
+    // the left; spatial splits clip references at that bin's lower plane
+    size_t bin = 0;
+    bool spatial = false;
+    BoundingBox left_box, right_box;
+    size_t left_count = 0, right_count = 0;
+    // Bins start at bin_min on axis, and bin_scale of them fit in a unit
+    real bin_min = 0.0, bin_scale = 0.0;
+  };
+
+  // The triangle each primitive is, or nullptr
+  std::vector<const Triangle *> triangles;
+  BoundingBox root_bounds;
+
+  // Builds the subtree over references, which may hold up to max_references
+  // references in all
+  std::shared_ptr<BVHTree::BVHTreeNode>
+  construct(std::vector<Reference> references, const size_t depth,
+            const real max_references);
+
+  Split object_split(const std::vector<Reference> &references,
+                     const BoundingBox &bounds) const;
+  Split spatial_split(const std::vector<Reference> &references,
+                      const BoundingBox &bounds) const;
+  // Sorts references into left and right, clipping or unsplitting those
+  // that straddle the split plane
+  void partition_spatial(const std::vector<Reference> &references,
+                         const Split &split, std::vector<Reference> &left,
+                         std::vector<Reference> &right) const;
+  // The parts of reference below and above position on axis. Either box is
+  // empty if no part of the primitive lies on that side.
+  std::pair<BoundingBox, BoundingBox> clip(const Reference &reference,
+                                           const int axis,
+                                           const real position) const;
+};
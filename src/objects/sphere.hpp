@@ -1,17 +1,110 @@
-
 #pragma once
 
 #include "hittable.hpp"
 
 #include "objects/bounding_box.hpp"
+#include "objects/hit_record.hpp"
 #include "util/util.hpp"
 
-struct HitRecord;
+#include <optional>
+
 struct Material;
 
+// A sphere's geometry and material by value, as BVHFlatTree packs them into
+// its sphere array. The tests are inline so traversal kernels can use them
+// without a virtual call; Sphere's own queries go through them too, so both
+// paths give the same hits.
+struct PackedSphere {
+  vec3 center;
+  real radius;
+  Material *material;
+
+  constexpr static vec2 get_uv(const vec3 &point) {
+    constexpr real pi = glm::pi<real>();
+    const real theta = std::acos(-point.y);
+    const real phi = std::atan2(-point.z, point.x) + pi;
+
+    const real u = phi / (2 * pi);
+    const real v = theta / pi;
+
+    return vec2(u, v);
+  }
+
+  // Distance to the nearest intersection within (t_min, t_max), if any
+  std::optional<real> nearest_root(const Ray &ray, const real t_min,
+                                   const real t_max) const {
+    if constexpr (SPECTRAL_SINGLE_PRECISION)
+      return widened_nearest_root(ray, t_min, t_max);
+
+    const vec3 co = center - ray.origin;
+    const real negative_half_b = glm::dot(co, ray.direction);
+    const real c = glm::length2(co) - radius * radius;
+
+    const real discriminant = negative_half_b * negative_half_b - c;
+    if (discriminant < 0.0)
+      return std::nullopt;
+
+    // Find the nearest root that lies in the acceptable range.
+    const real sqrt_d = std::sqrt(discriminant);
+    const real root0 = negative_half_b - sqrt_d;
+    const real root1 = negative_half_b + sqrt_d;
+
+    if (t_min < root0 && root0 < t_max)
+      return root0;
+    if (t_min < root1 && root1 < t_max)
+      return root1;
+    return std::nullopt;
+  }
+
+  // nearest_root for float builds, worked out in precise_real: for spheres as
+  // large as random_scene()'s ground, |co|^2 and radius^2 nearly cancel, and
+  // in float what is left is mostly rounding error, far larger than the ray
+  // offset. Float directions are also only unit length to within rounding,
+  // which grazing rays amplify, so the quadratic keeps its |direction|^2 term.
+  std::optional<real> widened_nearest_root(const Ray &ray, const real t_min,
+                                           const real t_max) const {
+    const precise_vec3 direction(ray.direction);
+    const precise_vec3 co = precise_vec3(center) - precise_vec3(ray.origin);
+    const precise_real a = glm::length2(direction);
+    const precise_real negative_half_b = glm::dot(co, direction);
+    const precise_real c =
+        glm::length2(co) - precise_real(radius) * precise_real(radius);
+
+    const precise_real discriminant = negative_half_b * negative_half_b - a * c;
+    if (discriminant < 0.0)
+      return std::nullopt;
+
+    const precise_real sqrt_d = std::sqrt(discriminant);
+    const precise_real root0 = (negative_half_b - sqrt_d) / a;
+    const precise_real root1 = (negative_half_b + sqrt_d) / a;
+
+    if (t_min < root0 && root0 < t_max)
+      return static_cast<real>(root0);
+    if (t_min < root1 && root1 < t_max)
+      return static_cast<real>(root1);
+    return std::nullopt;
+  }
+
+  bool hit(const Ray &ray, const real t_min, const real t_max,
+           HitRecord &record) const {
+    const std::optional<real> root = nearest_root(ray, t_min, t_max);
+    if (!root.has_value())
+      return false;
+
+    const vec3 hit_point = ray.at(*root);
+    const vec3 outward_normal = (hit_point - center) / radius;
+    const vec2 uv = get_uv(outward_normal);
+    return record.register_hit(ray, *root, uv, outward_normal, material);
+  }
+
+  bool occluded(const Ray &ray, const real t_min, const real t_max) const {
+    return nearest_root(ray, t_min, t_max).has_value();
+  }
+};
+
 struct Sphere : public Hittable {
-  const vec3 center = vec3(0.0);
-  const real radius = 1.0;
+  vec3 center = vec3(0.0);
+  real radius = 1.0;
   const std::shared_ptr<Material> material;
 
   Sphere(const vec3 &center, const real radius,
@@ -21,9 +114,22 @@ struct Sphere : public Hittable {
   }
   virtual ~Sphere() {}
 
-  constexpr static vec2 get_uv(const vec3 &point);
+  // Moves or resizes the sphere in place; BVHs holding it need a refit
+  void set_geometry(const vec3 &center, const real radius) {
+    debug_assert(radius > 0.0, "Sphere radius must be positive.");
+    this->center = center;
+    this->radius = radius;
+  }
+
+  PackedSphere packed() const { return {center, radius, material.get()}; }
+
+  constexpr static vec2 get_uv(const vec3 &point) {
+    return PackedSphere::get_uv(point);
+  }
 
   virtual bool hit(const Ray &ray, const real t_min, const real t_max,
                    HitRecord &record) const override;
+  virtual bool occluded(const Ray &ray, const real t_min,
+                        const real t_max) const override;
   virtual BoundingBox bounding_box() const override;
 };
@@ -4,17 +4,65 @@
 #include "hittable.hpp"
 
 #include "objects/bounding_box.hpp"
+#include "objects/hit_record.hpp"
 #include "util/util.hpp"
 
-struct HitRecord;
+#include <optional>
+
 struct Material;
 
+// What intersecting a triangle needs, by value, as BVHFlatTree packs them into
+// its triangle array. Triangle's own queries go through it too.
+struct PackedTriangle {
+  vec3 a, edge1, edge2, normal;
+  Material *material;
+
+  // Where the ray crosses the triangle within [t_min, t_max], as a distance
+  // and barycentric coordinates, if it does
+  std::optional<std::pair<real, vec2>>
+  intersect(const Ray &ray, const real t_min, const real t_max) const {
+    // Möller–Trumbore intersection algorithm
+    const vec3 tvec = ray.origin - a;
+    const vec3 pvec = glm::cross(ray.direction, edge2);
+    const vec3 qvec = glm::cross(tvec, edge1);
+    const real invDet = real(1.0) / glm::dot(edge1, pvec);
+
+    const real t = glm::dot(edge2, qvec) * invDet;
+    if (t < t_min || t > t_max)
+      return std::nullopt;
+
+    const real u = glm::dot(tvec, pvec) * invDet;
+    if (u < 0.0 || u > 1.0)
+      return std::nullopt;
+
+    const real v = glm::dot(ray.direction, qvec) * invDet;
+    if (v < 0.0 || u + v > 1.0)
+      return std::nullopt;
+
+    return std::make_pair(t, vec2(u, v));
+  }
+
+  bool hit(const Ray &ray, const real t_min, const real t_max,
+           HitRecord &record) const {
+    const auto intersection = intersect(ray, t_min, t_max);
+    if (!intersection.has_value())
+      return false;
+
+    const auto &[t, uv] = *intersection;
+    return record.register_hit(ray, t, uv, normal, material);
+  }
+
+  bool occluded(const Ray &ray, const real t_min, const real t_max) const {
+    return intersect(ray, t_min, t_max).has_value();
+  }
+};
+
 struct Triangle : public Hittable {
-  const vec3 a, b, c;
+  vec3 a, b, c;
   const std::shared_ptr<Material> m_material;
 
   // TODO: Add support for normals
-  const vec3 m_edge1, m_edge2, m_normal;
+  vec3 m_edge1, m_edge2, m_normal;
 
   Triangle(const vec3 &a, const vec3 &b, const vec3 &c,
            std::shared_ptr<Material> material)
@@ -22,8 +70,24 @@ struct Triangle : public Hittable {
         m_normal(glm::normalize(glm::cross(m_edge1, m_edge2))) {}
   virtual ~Triangle() {}
 
+  // Moves the triangle in place; BVHs holding it need a refit
+  void set_vertices(const vec3 &a, const vec3 &b, const vec3 &c) {
+    this->a = a;
+    this->b = b;
+    this->c = c;
+    m_edge1 = b - a;
+    m_edge2 = c - a;
+    m_normal = glm::normalize(glm::cross(m_edge1, m_edge2));
+  }
+
+  PackedTriangle packed() const {
+    return {a, m_edge1, m_edge2, m_normal, m_material.get()};
+  }
+
   virtual bool hit(const Ray &ray, const real t_min, const real t_max,
                    HitRecord &record) const override;
+  virtual bool occluded(const Ray &ray, const real t_min,
+                        const real t_max) const override;
 
   virtual BoundingBox bounding_box() const override {
     BoundingBox result;
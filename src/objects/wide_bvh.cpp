@@ -0,0 +1,160 @@
+#include "wide_bvh.hpp"
+
+#include "objects/hit_record.hpp"
+
+#include <algorithm>
+
+template <size_t Width>
+WideBVH<Width>::WideBVH(const BVHFlatTree &binary)
+    : primitives(binary.primitives), box(binary.bounding_box()) {
+  Timer timer;
+  nodes.reserve(binary.nodes.size() / (Width - 1) + 1);
+
+  // A leaf at the root still gets a node, so traversal always starts at one
+  const BVHFlatTree::BVHNode &root = binary.nodes[0];
+  if (root.is_leaf()) {
+    nodes.emplace_back();
+    nodes[0].set_child(0, root.box, root.primitive_index, root.num_primitives);
+    nodes[0].num_children = 1;
+    depth = 1;
+  } else {
+    collapse(binary, 0, 1);
+  }
+
+  fmt::println("Collapsed {} binary nodes into {} {}-wide nodes in {:.3f} ns",
+               binary.nodes.size(), nodes.size(), Width,
+               timer.elapsed_nanoseconds());
+}
+
+template <size_t Width>
+uint32_t WideBVH<Width>::collapse(const BVHFlatTree &binary,
+                                  const size_t binary_idx,
+                                  const size_t node_depth) {
+  depth = std::max(depth, node_depth);
+
+  // Keep opening the inner child with the largest surface area, the one rays
+  // are likeliest to enter, until the node is full
+  std::array<uint32_t, Width> children;
+  size_t num_children = 0;
+  children[num_children++] = binary.nodes[binary_idx].child_index;
+  children[num_children++] = binary.nodes[binary_idx].child_index + 1;
+  while (num_children < Width) {
+    size_t best_slot = Width;
+    real best_area = 0.0;
+    for (size_t slot = 0; slot < num_children; ++slot) {
+      const BVHFlatTree::BVHNode &child = binary.nodes[children[slot]];
+      if (!child.is_leaf() &&
+          (best_slot == Width || child.box.surface_area() > best_area)) {
+        best_slot = slot;
+        best_area = child.box.surface_area();
+      }
+    }
+    if (best_slot == Width)
+      break;
+    const uint32_t opened = children[best_slot];
+    children[best_slot] = binary.nodes[opened].child_index;
+    children[num_children++] = binary.nodes[opened].child_index + 1;
+  }
+
+  const uint32_t node_idx = nodes.size();
+  nodes.emplace_back();
+  nodes[node_idx].num_children = num_children;
+  for (size_t slot = 0; slot < num_children; ++slot) {
+    const BVHFlatTree::BVHNode &child = binary.nodes[children[slot]];
+    // Recurse before taking a reference: collapsing may grow the node array
+    const uint32_t index =
+        child.is_leaf() ? child.primitive_index
+                        : collapse(binary, children[slot], node_depth + 1);
+    nodes[node_idx].set_child(slot, child.box, index, child.num_primitives);
+  }
+  return node_idx;
+}
+
+template <size_t Width>
+bool WideBVH<Width>::hit(const Ray &ray, const real t_min, const real t_max,
+                         HitRecord &record) const {
+  // Children waiting to be visited, along with where the ray enters them
+  struct Entry {
+    uint32_t index;
+    uint16_t num_primitives;
+    real t;
+  };
+  // Each node pushes at most Width - 1 entries more than it pops
+  constexpr size_t stack_capacity = BVHFlatTree::max_stack_depth * Width;
+  std::array<Entry, stack_capacity> local_stack;
+  std::vector<Entry> heap_stack;
+  Entry *stack = local_stack.data();
+  if (depth * (Width - 1) + 1 > stack_capacity) {
+    heap_stack.resize(depth * (Width - 1) + 1);
+    stack = heap_stack.data();
+  }
+
+  const PrecomputedRay precomputed(ray);
+  real closest_so_far = std::min(t_max, record.t);
+  bool hit_anything = false;
+  size_t stack_size = 0;
+  stack[stack_size++] = {0, 0, t_min};
+
+  while (stack_size > 0) {
+    const Entry entry = stack[--stack_size];
+    if (entry.t >= closest_so_far)
+      continue;
+
+    if (entry.num_primitives > 0) {
+      for (size_t i = 0; i < entry.num_primitives; ++i) {
+        const auto &primitive = primitives[entry.index + i];
+        if (primitive->hit(ray, t_min, closest_so_far, record)) {
+          hit_anything = true;
+          closest_so_far = record.t;
+        }
+      }
+      continue;
+    }
+
+    // Slab test against every slot at once. The ray's direction signs pick
+    // the entry and exit planes on each axis; only the node's first
+    // num_children results are read.
+    const Node &node = nodes[entry.index];
+    std::array<real, Width> t_near, t_far;
+    t_near.fill(t_min);
+    t_far.fill(closest_so_far);
+    for (int axis = 0; axis < 3; ++axis) {
+      const bool negative = precomputed.direction_is_negative[axis];
+      const std::array<real, Width> &near_planes =
+          negative ? node.max[axis] : node.min[axis];
+      const std::array<real, Width> &far_planes =
+          negative ? node.min[axis] : node.max[axis];
+      const real origin = precomputed.origin[axis];
+      const real inv_direction = precomputed.inv_direction[axis];
+      for (size_t child = 0; child < Width; ++child) {
+        t_near[child] = std::max(t_near[child],
+                                 (near_planes[child] - origin) * inv_direction);
+        t_far[child] = std::min(t_far[child],
+                                (far_planes[child] - origin) * inv_direction);
+      }
+    }
+
+    // Push the children that were entered farthest first, so the nearest is
+    // popped next
+    std::array<size_t, Width> order;
+    size_t num_hit = 0;
+    for (size_t child = 0; child < node.num_children; ++child) {
+      if (!(t_near[child] <= t_far[child]))
+        continue;
+      size_t i = num_hit++;
+      for (; i > 0 && t_near[order[i - 1]] < t_near[child]; --i)
+        order[i] = order[i - 1];
+      order[i] = child;
+    }
+    for (size_t i = 0; i < num_hit; ++i) {
+      const size_t child = order[i];
+      stack[stack_size++] = {node.child_index[child],
+                             node.num_primitives[child], t_near[child]};
+    }
+  }
+
+  return hit_anything;
+}
+
+template struct WideBVH<4>;
+template struct WideBVH<8>;
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "objects/bounding_box.hpp"
+#include "objects/bvh.hpp"
+#include "objects/hittable.hpp"
+
+#include <array>
+#include <vector>
+
+// A BVH with up to Width children per node, collapsed from a BVHFlatTree.
+// Each node stores its children's bounds SoA, as min[axis][child] and
+// max[axis][child], so one pass over the lanes tests a ray against every child
+// at once. Children the ray enters are visited nearest first. Only the first
+// num_children slots of a node hold children; the builds use -ffast-math, so
+// nothing relies on infinite bounds or distances to mark the rest.
+//
+// Instantiated for 4 and 8 children; a drop-in alternative to BVHFlatTree.
+template <size_t Width> struct WideBVH : public Hittable {
+  static_assert(Width >= 2 && Width <= 16, "Unsupported BVH width");
+
+  struct alignas(64) Node {
+    // Slots from num_children on are unused, and keep zeroed bounds so the
+    // slab test over every lane stays on finite values
+    std::array<std::array<real, Width>, 3> min = {}, max = {};
+    // Index of an inner child node, or of a leaf child's first primitive
+    std::array<uint32_t, Width> child_index = {};
+    // Number of primitives in each leaf child; 0 for inner children
+    std::array<uint16_t, Width> num_primitives = {};
+    uint8_t num_children = 0;
+
+    inline void set_child(const size_t slot, const BoundingBox &box,
+                          const uint32_t index,
+                          const uint16_t num_primitives) {
+      for (int axis = 0; axis < 3; ++axis) {
+        min[axis][slot] = box.min[axis];
+        max[axis][slot] = box.max[axis];
+      }
+      child_index[slot] = index;
+      this->num_primitives[slot] = num_primitives;
+    }
+  };
+
+  std::vector<Node> nodes;
+  std::vector<std::shared_ptr<Hittable>> primitives;
+  BoundingBox box;
+  size_t depth = 0;
+
+  WideBVH(const std::vector<std::shared_ptr<Hittable>> &primitives,
+          const size_t num_threads = default_num_threads())
+      : WideBVH(BVHFlatTree(primitives, num_threads)) {}
+  explicit WideBVH(const BVHFlatTree &binary);
+  virtual ~WideBVH() {}
+
+  virtual bool hit(const Ray &ray, const real t_min, const real t_max,
+                   HitRecord &record) const override;
+
+  virtual BoundingBox bounding_box() const override { return box; }
+
+private:
+  // Turns the binary subtree rooted at binary_idx into wide nodes, returning
+  // the index of its root
+  uint32_t collapse(const BVHFlatTree &binary, const size_t binary_idx,
+                    const size_t node_depth);
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
@@ -0,0 +1,202 @@
+#include "distributed.hpp"
+
+#include <memory>
+#include <thread>
+
+namespace {
+
+void write_string(std::ostream &os, const std::string &value) {
+  write_binary<uint64_t>(os, value.size());
+  os.write(value.data(), value.size());
+}
+
+std::string read_string(std::istream &is) {
+  uint64_t size;
+  read_binary(is, size);
+  std::string value(size, '\0');
+  is.read(value.data(), size);
+  if (!is)
+    throw std::runtime_error("Unexpected end of message");
+  return value;
+}
+
+// Keeps trying while the coordinator starts up, so workers can be launched
+// before it
+Socket connect_with_retry(const std::string &address, const real seconds) {
+  Timer timer;
+  for (;;) {
+    try {
+      return Socket::connect(address);
+    } catch (const std::exception &) {
+      if (timer.elapsed_seconds() >= seconds ||
+          interrupt_requested.load(std::memory_order_relaxed))
+        throw;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+// Traces every tile the coordinator sends over this connection, each into a
+// fresh set of pixels, until it says it is done or goes away
+template <typename Pixel>
+void serve_tiles(const Socket &socket, const Scene &scene, const Camera &camera,
+                 const RenderJob &job, const RenderSettings &settings) {
+  const std::vector<Tile> tiles =
+      TileScheduler(job.width, job.height, job.tile_size).m_tiles;
+  std::vector<Colour> colours;
+
+  while (!interrupt_requested.load(std::memory_order_relaxed)) {
+    const auto message = receive_message(socket);
+    if (!message.has_value() ||
+        message->type != static_cast<uint32_t>(DistributedMessage::Tile))
+      return;
+
+    const size_t tile_index = decode_tile(*message);
+    if (tile_index >= tiles.size())
+      throw std::runtime_error(
+          fmt::format("Coordinator sent unknown tile {}", tile_index));
+    const Tile &tile = tiles[tile_index];
+    scene.trace_tile_colours(camera, settings, job.max_depth, job.width, tile,
+                             job.first_sample, job.samples_per_pixel, colours);
+
+    std::ostringstream os;
+    write_binary<uint64_t>(os, tile_index);
+    size_t idx = 0;
+    for (size_t i = 0; i < tile.num_pixels(); ++i) {
+      Pixel pixel;
+      for (size_t sample = 0; sample < job.samples_per_pixel; ++sample)
+        pixel.add_sample(colours[idx++]);
+      pixel.write_binary(os);
+    }
+    if (!send_message(socket,
+                      {static_cast<uint32_t>(DistributedMessage::TileResult),
+                       os.str()}))
+      return;
+  }
+}
+
+} // namespace
+
+Message encode_job(const RenderJob &job) {
+  std::ostringstream os;
+  write_binary(os, distributed_protocol_version);
+  write_string(os, job.scene);
+  write_binary(os, job.pixel_type);
+  write_binary(os, job.width);
+  write_binary(os, job.height);
+  write_binary(os, job.samples_per_pixel);
+  write_binary(os, job.max_depth);
+  write_binary(os, job.tile_size);
+  write_binary(os, job.seed);
+  write_binary(os, job.first_sample);
+  return {static_cast<uint32_t>(DistributedMessage::Job), os.str()};
+}
+
+RenderJob decode_job(const Message &message) {
+  if (message.type != static_cast<uint32_t>(DistributedMessage::Job))
+    throw std::runtime_error("Expected a job from the coordinator");
+  std::istringstream is(message.payload);
+  uint32_t version;
+  read_binary(is, version);
+  if (version != distributed_protocol_version)
+    throw std::runtime_error(
+        fmt::format("Coordinator speaks protocol version {}, expected {}",
+                    version, distributed_protocol_version));
+
+  RenderJob job;
+  job.scene = read_string(is);
+  read_binary(is, job.pixel_type);
+  read_binary(is, job.width);
+  read_binary(is, job.height);
+  read_binary(is, job.samples_per_pixel);
+  read_binary(is, job.max_depth);
+  read_binary(is, job.tile_size);
+  read_binary(is, job.seed);
+  read_binary(is, job.first_sample);
+  return job;
+}
+
+Message encode_tile(const size_t tile_index) {
+  std::ostringstream os;
+  write_binary<uint64_t>(os, tile_index);
+  return {static_cast<uint32_t>(DistributedMessage::Tile), os.str()};
+}
+
+size_t decode_tile(const Message &message) {
+  std::istringstream is(message.payload);
+  uint64_t tile_index;
+  read_binary(is, tile_index);
+  return tile_index;
+}
+
+void run_worker(const std::string &address, const SceneRegistry &scenes,
+                const size_t num_connections, const RenderSettings &settings,
+                const DistributedSettings &distributed) {
+  debug_assert(num_connections > 0, "Need at least one connection");
+  const auto connect = [&]() {
+    Socket socket =
+        connect_with_retry(address, distributed.connect_timeout_seconds);
+    const auto message = receive_message(socket);
+    if (!message.has_value())
+      throw std::runtime_error(
+          fmt::format("Coordinator at '{}' closed the connection", address));
+    return std::make_pair(std::move(socket), decode_job(*message));
+  };
+
+  auto first_connection = connect();
+  const RenderJob job = first_connection.second;
+  const auto loader = scenes.find(job.scene);
+  if (loader == scenes.end())
+    throw std::runtime_error(fmt::format("Unknown scene '{}'", job.scene));
+
+  Scene scene;
+  Camera camera = loader->second(scene);
+  camera.image_width = job.width;
+  camera.image_height = job.height;
+  camera.update_constants();
+  RenderSettings job_settings = settings;
+  job_settings.seed = job.seed;
+  fmt::println("Rendering scene '{}' ({}x{}, {} spp) for '{}' on {} "
+               "connections",
+               job.scene, job.width, job.height, job.samples_per_pixel,
+               address, num_connections);
+
+  const auto serve = [&](const Socket &socket) {
+    switch (job.pixel_type) {
+    case RGBPixel::type_id:
+      serve_tiles<RGBPixel>(socket, scene, camera, job, job_settings);
+      return;
+    case RGBVariancePixel::type_id:
+      serve_tiles<RGBVariancePixel>(socket, scene, camera, job, job_settings);
+      return;
+    default:
+      throw std::runtime_error(fmt::format(
+          "Pixel type {} can't be rendered by workers", job.pixel_type));
+    }
+  };
+
+  // Exceptions can't cross threads, so each connection reports its own
+  // failure and the others keep going
+  const auto serve_connection = [&](const auto &open_socket) {
+    try {
+      serve(open_socket());
+    } catch (const std::exception &e) {
+      fmt::println("Worker connection failed: {}", e.what());
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_connections; ++i) {
+    threads.emplace_back([&]() {
+      serve_connection([&]() {
+        auto [socket, other_job] = connect();
+        if (other_job.scene != job.scene || other_job.seed != job.seed)
+          throw std::runtime_error("Coordinator changed jobs mid-render");
+        return std::move(socket);
+      });
+    });
+  }
+  serve_connection([&]() { return std::move(first_connection.first); });
+  for (auto &thread : threads)
+    thread.join();
+}
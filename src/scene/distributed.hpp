@@ -0,0 +1,254 @@
+#pragma once
+
+#include "scene/scene.hpp"
+#include "util/binary_io.hpp"
+#include "util/socket.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <poll.h>
+#include <sstream>
+
+// Coordinator / worker rendering. The coordinator owns the image and hands out
+// tiles; each worker process builds the scene itself (including its own BVH),
+// renders the tiles it is given and sends back their accumulators. Only the
+// job description, tile indices and finished tiles cross the wire:
+//
+//   coordinator -> worker   Job         RenderJob, once per connection
+//   coordinator -> worker   Tile        tile index
+//   worker -> coordinator   TileResult  tile index, then the tile's pixels in
+//                                       row-major order (Pixel::write_binary)
+//   coordinator -> worker   Done        no more tiles
+//
+// Samples are keyed by pixel and sample index, so a tile renders to the same
+// accumulators no matter which worker traces it. That lets the coordinator
+// hand the tiles of a dead worker to another one, and give copies of a slow
+// worker's tiles to idle ones, keeping whichever copy arrives first.
+constexpr uint32_t distributed_protocol_version = 2;
+
+enum class DistributedMessage : uint32_t {
+  Job = 1,
+  Tile = 2,
+  TileResult = 3,
+  Done = 4,
+};
+
+struct RenderJob {
+  std::string scene; // Looked up in each worker's SceneRegistry
+  uint32_t pixel_type = 0;
+  uint64_t width = 0, height = 0;
+  uint64_t samples_per_pixel = 0;
+  uint64_t max_depth = 0;
+  uint64_t tile_size = 32;
+  uint64_t seed = 0;
+  uint64_t first_sample = 0;
+};
+
+// Builds a named scene into `scene` and returns the camera looking at it
+using SceneLoader = std::function<Camera(Scene &scene)>;
+using SceneRegistry = std::map<std::string, SceneLoader, std::less<>>;
+
+struct DistributedSettings {
+  // Once every tile has been handed out, idle workers get copies of tiles that
+  // have been out for longer than this
+  real reassign_after_seconds = 10.0;
+  // Workers that stall mid-message for this long are dropped, and their tiles
+  // handed out again. Messages are buffered as they arrive, so a stalled
+  // worker never holds up the others.
+  real receive_timeout_seconds = 30.0;
+  // How long workers keep retrying to reach a coordinator that isn't up yet
+  real connect_timeout_seconds = 10.0;
+};
+
+Message encode_job(const RenderJob &job);
+RenderJob decode_job(const Message &message);
+Message encode_tile(const size_t tile_index);
+size_t decode_tile(const Message &message);
+
+// Connects to the coordinator at address with num_connections connections,
+// each rendering one tile at a time on its own thread, until the coordinator
+// runs out of tiles or the process is interrupted. The scene is built once,
+// from the registry entry the job names.
+void run_worker(const std::string &address, const SceneRegistry &scenes,
+                const size_t num_connections,
+                const RenderSettings &settings = RenderSettings(),
+                const DistributedSettings &distributed = DistributedSettings());
+
+// Serves the job's tiles to every worker that connects to address, and
+// collects their accumulators into the image. Returns false if interrupted
+// before every tile came back.
+template <typename Pixel>
+bool coordinate_render(const std::string &address, const RenderJob &job,
+                       OutputImage<Pixel> &image,
+                       const DistributedSettings &settings =
+                           DistributedSettings()) {
+  using clock = std::chrono::steady_clock;
+  debug_assert(job.pixel_type == Pixel::type_id &&
+                   job.width == image.m_width && job.height == image.m_height,
+               "Job does not describe a {}x{} image of pixel type {}",
+               image.m_width, image.m_height, Pixel::type_id);
+
+  struct Worker {
+    Socket socket;
+    MessageReader reader;
+    std::optional<size_t> tile;
+    clock::time_point assigned_at;
+    clock::time_point last_received;
+  };
+
+  const Socket listener = Socket::listen(address);
+  const Message job_message = encode_job(job);
+  const std::vector<Tile> tiles =
+      TileScheduler(image.m_width, image.m_height, job.tile_size).m_tiles;
+  std::deque<size_t> pending(tiles.size());
+  std::iota(pending.begin(), pending.end(), 0);
+  std::vector<uint8_t> tile_done(tiles.size(), 0);
+  // Workers currently holding a copy of each tile
+  std::vector<size_t> tile_copies(tiles.size(), 0);
+  size_t num_done = 0;
+  std::vector<Worker> workers;
+
+  // Prefers tiles nobody has, then the longest-overdue tile held by a single
+  // slow worker. Returns false if the worker could not be reached.
+  const auto assign = [&](Worker &worker) {
+    std::optional<size_t> tile;
+    while (!pending.empty() && !tile.has_value()) {
+      if (!tile_done[pending.front()] && tile_copies[pending.front()] == 0)
+        tile = pending.front();
+      pending.pop_front();
+    }
+    if (!tile.has_value()) {
+      const auto now = clock::now();
+      clock::time_point oldest = now;
+      for (const Worker &other : workers) {
+        if (!other.tile.has_value() || tile_copies[*other.tile] != 1 ||
+            other.assigned_at >= oldest)
+          continue;
+        const real seconds =
+            std::chrono::duration<real>(now - other.assigned_at).count();
+        if (seconds >= settings.reassign_after_seconds) {
+          tile = other.tile;
+          oldest = other.assigned_at;
+        }
+      }
+    }
+    if (!tile.has_value())
+      return true;
+
+    worker.tile = tile;
+    worker.assigned_at = clock::now();
+    ++tile_copies[*tile];
+    return send_message(worker.socket, encode_tile(*tile));
+  };
+
+  // Closes the connection; a tile nobody else is working on goes back in the
+  // queue
+  const auto drop = [&](Worker &worker) {
+    if (worker.tile.has_value() && --tile_copies[*worker.tile] == 0 &&
+        !tile_done[*worker.tile])
+      pending.push_front(*worker.tile);
+    worker.tile.reset();
+    worker.socket.close();
+  };
+
+  // Reads a finished tile into the image, unless another copy beat it to it
+  const auto receive_tile = [&](Worker &worker, const Message &message) {
+    if (message.type != static_cast<uint32_t>(DistributedMessage::TileResult))
+      return false;
+
+    try {
+      std::istringstream is(message.payload);
+      uint64_t tile_index;
+      read_binary(is, tile_index);
+      if (!worker.tile.has_value() || tile_index != *worker.tile)
+        return false;
+      if (!tile_done[tile_index]) {
+        const Tile &tile = tiles[tile_index];
+        for (size_t row = tile.row_begin; row < tile.row_end; ++row)
+          for (size_t col = tile.col_begin; col < tile.col_end; ++col)
+            image.m_pixels[row * image.m_width + col].read_binary(is);
+        tile_done[tile_index] = 1;
+        ++num_done;
+      }
+    } catch (const std::exception &e) {
+      fmt::println("\nDropping worker: {}", e.what());
+      return false;
+    }
+    --tile_copies[*worker.tile];
+    worker.tile.reset();
+    return true;
+  };
+
+  // Buffers whatever the worker has sent and handles every message it
+  // completes; a partial message just waits for the next poll
+  const auto receive = [&](Worker &worker) {
+    worker.last_received = clock::now();
+    if (!worker.reader.receive(worker.socket))
+      return false;
+    while (auto message = worker.reader.next())
+      if (!receive_tile(worker, *message))
+        return false;
+    return true;
+  };
+
+  // Whether the worker has stalled halfway through a message
+  const auto stalled = [&](const Worker &worker) {
+    return worker.reader.partial() &&
+           std::chrono::duration<real>(clock::now() - worker.last_received)
+                   .count() >= settings.receive_timeout_seconds;
+  };
+
+  interrupt_requested.store(false);
+  fmt::println("Coordinating {} tiles on '{}'", tiles.size(), address);
+  Timer timer;
+  std::vector<pollfd> fds;
+  while (num_done < tiles.size() &&
+         !interrupt_requested.load(std::memory_order_relaxed)) {
+    fds.assign(1, {listener.m_fd, POLLIN, 0});
+    for (const Worker &worker : workers)
+      fds.push_back({worker.socket.m_fd, POLLIN, 0});
+    if (::poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+      throw std::runtime_error("poll() failed while coordinating");
+
+    for (size_t i = 0; i < workers.size(); ++i)
+      if ((fds[i + 1].revents != 0 && !receive(workers[i])) ||
+          stalled(workers[i]))
+        drop(workers[i]);
+
+    if (fds[0].revents & POLLIN) {
+      while (auto socket = listener.accept()) {
+        socket->set_nonblocking();
+        if (send_message(*socket, job_message))
+          workers.push_back({std::move(*socket), {}, std::nullopt, {}, {}});
+      }
+    }
+
+    for (Worker &worker : workers)
+      if (worker.socket.is_open() && !worker.tile.has_value() &&
+          !assign(worker))
+        drop(worker);
+    std::erase_if(workers,
+                  [](const Worker &worker) { return !worker.socket.is_open(); });
+
+    if (timer.seconds_since_last_update("print_progress") >= 0.1) {
+      timer.update("print_progress");
+      fmt::print("\33[2K\rTiles: {} / {}, workers: {}, elapsed: {:.2f}s",
+                 num_done, tiles.size(), workers.size(),
+                 timer.elapsed_seconds());
+      std::cout << std::flush;
+    }
+  }
+
+  for (const Worker &worker : workers)
+    send_message(worker.socket,
+                 {static_cast<uint32_t>(DistributedMessage::Done), {}});
+
+  fmt::println("\33[2K\rTiles: {} / {} in {:.2f}s", num_done, tiles.size(),
+               timer.elapsed_seconds());
+  return num_done == tiles.size();
+}
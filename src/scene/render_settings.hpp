@@ -0,0 +1,43 @@
+#pragma once
+
+#include "scene/tile_scheduler.hpp"
+
+#include <string>
+
+enum class Integrator {
+  Reference, // Scene::ray_colour, one path at a time
+  Wavefront, // WavefrontIntegrator, batches of paths one stage at a time
+};
+
+struct RenderSettings {
+  size_t num_threads = default_num_threads();
+  size_t tile_size = 32;
+  uint64_t seed = 0; // Keys the per-pixel, per-sample RNG streams
+  // Index of the first sample Scene::render traces for each pixel. Processes
+  // rendering disjoint sample ranges of the same frame draw independent RNG
+  // streams, so their checkpoints can be merged into one image.
+  size_t first_sample = 0;
+  Integrator integrator = Integrator::Reference;
+  // Trace primary rays, and bounces off perfect mirrors, in packets of
+  // packet_size rays through the reference integrator. Off by default until
+  // packets are shown to win on the scenes we render.
+  bool ray_packets = false;
+
+  // Where Scene::render saves its accumulators; empty disables checkpoints
+  std::string checkpoint_path;
+  real checkpoint_interval_seconds = 60.0;
+  // Continue from checkpoint_path, if it exists, instead of starting over
+  bool resume = false;
+};
+
+struct AdaptiveSettings {
+  // Every pixel gets this many samples before its error is first estimated
+  size_t min_samples_per_pixel = 16;
+  // No pixel gets more than this many samples
+  size_t max_samples_per_pixel = 1024;
+  // The whole image never takes more than this many samples per pixel, on
+  // average; this is the same budget a fixed-rate render would spend
+  size_t average_samples_per_pixel = 100;
+  // Pixels stop receiving samples once their relative error is below this
+  real target_relative_error = 0.01;
+};
@@ -5,9 +5,9 @@
 #include "objects/hit_record.hpp"
 #include "util/spectral_conversion.hpp"
 
-Colour Scene::ray_colour(RNG &random, const size_t max_depth,
-                         const Ray &ray) const {
-  Colour colour(1.0, 1.0, 1.0);
+Colour Scene::ray_colour(RNG &random, const size_t max_depth, const Ray &ray,
+                         const Colour &throughput) const {
+  Colour colour = throughput;
   Ray current_ray = ray;
   for (size_t depth = 0; depth < max_depth; ++depth) {
     HitRecord record;
@@ -28,6 +28,125 @@ Colour Scene::ray_colour(RNG &random, const size_t max_depth,
   return Colour(0.0, 0.0, 0.0);
 }
 
+void Scene::packet_ray_colour(std::array<RNG, packet_size> &randoms,
+                              const size_t max_depth,
+                              std::array<Ray, packet_size> rays, uint32_t mask,
+                              std::array<Colour, packet_size> &colours) const {
+  std::array<Colour, packet_size> throughputs;
+  throughputs.fill(Colour(1.0, 1.0, 1.0));
+  colours.fill(Colour(0.0, 0.0, 0.0));
+
+  for (size_t depth = 0; depth < max_depth && mask != 0; ++depth) {
+    RayPacket<packet_size> packet;
+    for (size_t lane = 0; lane < packet_size; ++lane)
+      if (mask & (1u << lane))
+        packet.set_ray(lane, rays[lane]);
+
+    std::array<HitRecord, packet_size> records;
+    const uint32_t hit_mask = world.hit_packet(packet, 0.0001, records.data());
+
+    for (size_t lane = 0; lane < packet_size; ++lane) {
+      if (!(mask & (1u << lane)))
+        continue;
+      if (!(hit_mask & (1u << lane))) {
+        colours[lane] = throughputs[lane] * get_background_colour(rays[lane]);
+        mask &= ~(1u << lane);
+        continue;
+      }
+
+      const HitRecord &record = records[lane];
+      Ray scattered;
+      Colour attenuation;
+      if (!record.material->scatter(randoms[lane], rays[lane], record,
+                                    attenuation, scattered)) {
+        mask &= ~(1u << lane);
+        continue;
+      }
+      throughputs[lane] *= attenuation;
+
+      // Rays that scatter incoherently finish on their own
+      if (!record.material->is_perfect_mirror()) {
+        colours[lane] = ray_colour(randoms[lane], max_depth - depth - 1,
+                                   scattered, throughputs[lane]);
+        mask &= ~(1u << lane);
+        continue;
+      }
+      rays[lane] = scattered;
+    }
+  }
+}
+
+void Scene::trace_tile_packets(const Camera &camera,
+                               const RenderSettings &settings,
+                               const size_t max_depth, const size_t image_width,
+                               const Tile &tile, const size_t first_sample,
+                               const size_t num_samples,
+                               std::vector<Colour> &colours) const {
+  const size_t total_paths = tile.num_pixels() * num_samples;
+  const size_t tile_width = tile.col_end - tile.col_begin;
+  colours.resize(total_paths);
+
+  // Consecutive paths are samples of the same or neighbouring pixels, so each
+  // packet starts out coherent
+  for (size_t first_path = 0; first_path < total_paths;
+       first_path += packet_size) {
+    std::array<RNG, packet_size> randoms;
+    std::array<Ray, packet_size> rays;
+    uint32_t mask = 0;
+    for (size_t lane = 0; lane < packet_size; ++lane) {
+      const size_t path = first_path + lane;
+      if (path >= total_paths)
+        break;
+      const size_t pixel_in_tile = path / num_samples;
+      const size_t row = tile.row_begin + pixel_in_tile / tile_width;
+      const size_t col = tile.col_begin + pixel_in_tile % tile_width;
+      const size_t sample = first_sample + path % num_samples;
+
+      randoms[lane] =
+          RNG::for_sample(settings.seed, row * image_width + col, sample);
+      const vec2 pixel = vec2(col + 0.5, row + 0.5);
+      const vec2 jitter = randoms[lane].random_vec2(-0.5, 0.5);
+      rays[lane] = camera.get_ray(pixel + jitter, randoms[lane]);
+      mask |= 1u << lane;
+    }
+
+    std::array<Colour, packet_size> packet_colours;
+    packet_ray_colour(randoms, max_depth, rays, mask, packet_colours);
+    for (size_t lane = 0; lane < packet_size; ++lane)
+      if (mask & (1u << lane))
+        colours[first_path + lane] = packet_colours[lane];
+  }
+}
+
+void Scene::trace_tile_colours(const Camera &camera,
+                               const RenderSettings &settings,
+                               const size_t max_depth, const size_t image_width,
+                               const Tile &tile, const size_t first_sample,
+                               const size_t num_samples,
+                               std::vector<Colour> &colours) const {
+  if (settings.integrator == Integrator::Wavefront) {
+    // One integrator per worker thread, so its path buffers outlive the tile
+    thread_local WavefrontIntegrator integrator;
+    integrator.bind(*this, camera, max_depth, settings.seed, image_width);
+    integrator.trace_tile(tile, first_sample, num_samples, colours);
+    return;
+  }
+  if (settings.ray_packets) {
+    trace_tile_packets(camera, settings, max_depth, image_width, tile,
+                       first_sample, num_samples, colours);
+    return;
+  }
+
+  colours.clear();
+  colours.reserve(tile.num_pixels() * num_samples);
+  for (size_t row = tile.row_begin; row < tile.row_end; ++row)
+    for (size_t col = tile.col_begin; col < tile.col_end; ++col)
+      for (size_t i = 0; i < num_samples; ++i)
+        colours.push_back(sample_pixel(camera, settings, max_depth,
+                                       image_width, row, col,
+                                       first_sample + i));
+}
+
 real Scene::get_intensity(RNG &random, const size_t max_depth,
                           const Ray &ray) const {
   const real wavelength = ray.wavelength;
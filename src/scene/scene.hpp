@@ -4,14 +4,42 @@
 #include "fmt/color.h"
 #include "fmt/core.h"
 
+#include "objects/bvh_stats.hpp"
 #include "objects/hittable.hpp"
 #include "objects/hittable_list.hpp"
 #include "scene/camera.hpp"
+#include "scene/render_settings.hpp"
+#include "scene/tile_scheduler.hpp"
+#include "scene/wavefront.hpp"
+#include "util/checkpoint.hpp"
+#include "util/image_writer.hpp"
+#include "util/interrupt.hpp"
 #include "util/output_image.hpp"
 #include "util/timer.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+struct TimedRenderResult {
+  // Samples each pixel received, in row-major order
+  std::vector<size_t> samples_per_pixel;
+  size_t min_samples_per_pixel = 0;
+  size_t max_samples_per_pixel = 0;
+  real average_samples_per_pixel = 0.0;
+};
+
 struct Scene {
   HittableList world;
+  // Progress snapshots and results are encoded in the background; writes
+  // still in flight finish when the scene is destroyed
+  AsyncImageWriter image_writer;
+  // Guards image accumulators while tiles are committed, snapshotted or
+  // checkpointed
+  mutable std::mutex image_mutex;
 
   Scene(const HittableList &world = HittableList()) : world(world) {}
 
@@ -20,36 +48,135 @@ struct Scene {
   constexpr Colour get_background_colour(const Ray &ray) const {
     return Colour(1.0, 0.0, 0.0);
     const vec3 unit_direction = glm::normalize(ray.direction);
-    const auto a = 0.5 * (unit_direction.y + 1.0);
-    return (1.0 - a) * Colour(1.0, 1.0, 1.0) + a * Colour(0.5, 0.7, 1.0);
+    const real a = real(0.5) * (unit_direction.y + real(1.0));
+    return (real(1.0) - a) * Colour(1.0, 1.0, 1.0) + a * Colour(0.5, 0.7, 1.0);
 
     const real t = 0.5 * (ray.direction.y + 1.0);
     return (static_cast<real>(1.0) - t) * Colour(1.0, 1.0, 1.0) +
            t * Colour(0.5, 0.7, 1.0);
   }
 
-  Colour ray_colour(RNG &random, const size_t max_depth, const Ray &ray) const;
+  Colour ray_colour(RNG &random, const size_t max_depth, const Ray &ray,
+                    const Colour &throughput = Colour(1.0, 1.0, 1.0)) const;
+  void packet_ray_colour(std::array<RNG, packet_size> &randoms,
+                         const size_t max_depth,
+                         std::array<Ray, packet_size> rays, uint32_t mask,
+                         std::array<Colour, packet_size> &colours) const;
+  void trace_tile_packets(const Camera &camera, const RenderSettings &settings,
+                          const size_t max_depth, const size_t image_width,
+                          const Tile &tile, const size_t first_sample,
+                          const size_t num_samples,
+                          std::vector<Colour> &colours) const;
   real get_intensity(RNG &random, const size_t max_depth, const Ray &ray) const;
 
+  template <typename Pixel>
+  void write_snapshot(const OutputImage<Pixel> &image) {
+    std::lock_guard lock(image_mutex);
+    image_writer.write_snapshot_png(image, "output/progress.png");
+  }
+
+  // Adapts trace_pixel(row, col, samples), which appends every sample it takes
+  // for one pixel to samples, into a tracer for whole tiles. Like
+  // trace_samples, the tile is traced into a local buffer and only added to
+  // the image while holding image_mutex.
+  template <typename Pixel, typename TracePixel>
+  auto per_pixel(OutputImage<Pixel> &image,
+                 const TracePixel &trace_pixel) const {
+    return [this, &image, &trace_pixel](const Tile &tile) {
+      std::vector<typename Pixel::sample_t> samples;
+      std::vector<size_t> pixel_ends;
+      pixel_ends.reserve(tile.num_pixels());
+      for (size_t row = tile.row_begin; row < tile.row_end; ++row)
+        for (size_t col = tile.col_begin; col < tile.col_end; ++col) {
+          trace_pixel(row, col, samples);
+          pixel_ends.push_back(samples.size());
+        }
+
+      std::lock_guard lock(image_mutex);
+      size_t idx = 0, pixel = 0;
+      for (size_t row = tile.row_begin; row < tile.row_end; ++row)
+        for (size_t col = tile.col_begin; col < tile.col_end; ++col, ++pixel)
+          for (; idx < pixel_ends[pixel]; ++idx)
+            image.add_pixel_sample(row, col, samples[idx]);
+      return samples.size();
+    };
+  }
+
+  // Renders samples_per_pixel samples of every pixel, starting from sample
+  // settings.first_sample. With a checkpoint path set, the accumulators are
+  // saved periodically and when the process is interrupted; with resume set,
+  // rendering continues from that checkpoint and only traces the samples it
+  // is missing. Returns false if interrupted.
   template <typename Pixel, bool do_progress_updates = true>
-  void render(const Camera &camera, OutputImage<Pixel> &image,
-              const size_t samples_per_pixel, const size_t max_depth) {
+  bool render(const Camera &camera, OutputImage<Pixel> &image,
+              const size_t samples_per_pixel, const size_t max_depth,
+              RenderSettings settings = RenderSettings()) {
+    // A Ctrl-C that stopped an earlier render must not stop this one
+    interrupt_requested.store(false);
+    if (settings.resume && !settings.checkpoint_path.empty()) {
+      const auto info = load_checkpoint(settings.checkpoint_path, image);
+      if (info.has_value()) {
+        // Tiles and RNG streams must line up with the checkpointed ones
+        settings.tile_size = info->tile_size;
+        settings.seed = info->seed;
+        settings.first_sample = info->first_sample;
+        fmt::println("Resuming from checkpoint '{}'",
+                     settings.checkpoint_path);
+      }
+    }
+    // Runs on the main thread while the workers are still tracing, so a failed
+    // save is reported rather than thrown: the previous checkpoint is intact,
+    // and the next save may well succeed. Returns whether a checkpoint was
+    // saved.
+    const auto save = [&]() {
+      if (settings.checkpoint_path.empty())
+        return false;
+      std::lock_guard lock(image_mutex);
+      try {
+        save_checkpoint(settings.checkpoint_path, image, settings.tile_size,
+                        settings.seed, settings.first_sample);
+        return true;
+      } catch (const std::exception &e) {
+        fmt::println("\n{}", e.what());
+        return false;
+      }
+    };
+
+    size_t samples_before = 0;
+    for (const Pixel &pixel : image.m_pixels)
+      samples_before += std::min(pixel.num_samples(), samples_per_pixel);
+
     const size_t total_samples =
         image.m_width * image.m_height * samples_per_pixel;
-    size_t num_samples = 0;
+    size_t num_samples = samples_before;
+
+    // Resuming a finished checkpoint leaves nothing to trace or time
+    if (samples_before == total_samples) {
+      image_writer.write_png(image,
+                             {"output/progress.png", "output/result.png",
+                              "public_output/result.png"});
+      fmt::println("Nothing left to render: every pixel already has {} "
+                   "samples.",
+                   samples_per_pixel);
+      return true;
+    }
 
     Timer timer;
+    TraversalStats::reset();
 
     const auto print_progress_update = [&]() {
       const real proportion_done =
-          static_cast<real>(num_samples) / total_samples;
+          static_cast<real>(num_samples - samples_before) /
+          (total_samples - samples_before);
       const real elapsed_seconds = timer.elapsed_seconds();
       const real remaining_seconds = elapsed_seconds / proportion_done;
-      const real samples_per_second = num_samples / elapsed_seconds;
+      const real samples_per_second =
+          (num_samples - samples_before) / elapsed_seconds;
 
       fmt::print("\33[2K\r");
-      fmt::print("Progress: {} [", fmt::format(fmt::emphasis::bold, "{:.2f}%",
-                                               100.0 * proportion_done));
+      fmt::print("Progress: {} [",
+                 fmt::format(fmt::emphasis::bold, "{:.2f}%",
+                             100.0 * num_samples / total_samples));
       fmt::print(
           "elapsed_time: {} / {}, ",
           fmt::format(fmt::emphasis::bold, "{:.2f}s", elapsed_seconds),
@@ -63,75 +190,378 @@ struct Scene {
       std::cout << std::flush;
     };
 
-    RNG random;
-    for (size_t row = 0; row < image.m_height; ++row) {
-      for (size_t col = 0; col < image.m_width; ++col) {
-        const vec2 pixel = vec2(col + 0.5, row + 0.5);
-        for (size_t sample = 0; sample < samples_per_pixel; ++sample) {
-          const vec2 jitter = random.random_vec2(-0.5, 0.5);
-          const Ray ray = camera.get_ray(pixel + jitter, random);
-          const Colour colour = ray_colour(random, max_depth, ray);
-          image.add_pixel_sample(row, col, colour);
-          ++num_samples;
-        }
+    // Tiles are committed whole, so every pixel of a tile has the same count
+    const auto trace_tile = [&](const Tile &tile) -> size_t {
+      const size_t samples_done =
+          image.m_pixels[tile.row_begin * image.m_width + tile.col_begin]
+              .num_samples();
+      if (samples_done >= samples_per_pixel)
+        return 0;
+      return trace_samples(camera, image, settings, max_depth, tile,
+                           settings.first_sample + samples_done,
+                           samples_per_pixel - samples_done);
+    };
 
-        if constexpr (do_progress_updates) {
-          if (timer.seconds_since_last_update("progress_image") >= 1.0) {
-            timer.update("progress_image");
-            image.template write_png<true>("output/progress.png");
-          }
-          if (timer.seconds_since_last_update("print_progress") >= 0.1) {
-            timer.update("print_progress");
-            print_progress_update();
-          }
+    const auto on_tick = [&](const size_t samples_so_far) {
+      num_samples = samples_before + samples_so_far;
+      if constexpr (do_progress_updates) {
+        if (timer.seconds_since_last_update("progress_image") >= 1.0) {
+          timer.update("progress_image");
+          write_snapshot(image);
+        }
+        if (timer.seconds_since_last_update("print_progress") >= 0.1) {
+          timer.update("print_progress");
+          print_progress_update();
         }
       }
-    }
+      if (timer.seconds_since_last_update("checkpoint") >=
+          settings.checkpoint_interval_seconds) {
+        timer.update("checkpoint");
+        save();
+      }
+    };
+
+    render_tiles(image, settings, trace_tile, on_tick);
 
     print_progress_update();
     const real elapsed_seconds = timer.elapsed_seconds();
 
-    image.template write_png<true>("output/progress.png");
-    image.template write_png<true>("output/result.png");
-    image.template write_png<true>("public_output/result.png");
+    if (interrupt_requested.load()) {
+      const bool saved = save();
+      image_writer.write_png(image, {"output/progress.png"});
+      fmt::println("\nInterrupted after {:.2f} seconds.", elapsed_seconds);
+      if (saved)
+        fmt::println("Saved checkpoint to '{}'.", settings.checkpoint_path);
+      return false;
+    }
+
+    save();
+    image_writer.write_png(image, {"output/progress.png", "output/result.png",
+                                   "public_output/result.png"});
 
-    fmt::println("\nDone! Took {:.2f} seconds.", elapsed_seconds);
+    fmt::println("\nDone! Took {:.2f} seconds on {} threads.", elapsed_seconds,
+                 settings.num_threads);
+    if constexpr (SPECTRAL_TRAVERSAL_STATS)
+      fmt::println("Traversal: {}", TraversalStats::total().report());
+    return true;
   }
 
   template <typename Pixel>
   void just_render(const Camera &camera, OutputImage<Pixel> &image,
-                   const size_t samples_per_pixel, const size_t max_depth) {
-    RNG random;
-    for (size_t row = 0; row < image.m_height; ++row) {
-      for (size_t col = 0; col < image.m_width; ++col) {
-        const vec2 pixel = vec2(col + 0.5, row + 0.5);
+                   const size_t samples_per_pixel, const size_t max_depth,
+                   const RenderSettings &settings = RenderSettings()) {
+    const auto trace_tile = [&](const Tile &tile) {
+      return trace_samples(camera, image, settings, max_depth, tile, 0,
+                           samples_per_pixel);
+    };
+    render_tiles(image, settings, trace_tile, [](const size_t) {});
+    image_writer.write_png(image, {"output/progress.png"});
+  }
+
+  void render_spectral(const Camera &camera, SpectralImage &image,
+                       const size_t samples_per_pixel, const size_t max_depth,
+                       const RenderSettings &settings = RenderSettings()) {
+    const auto wavelengths = std::vector<real>{550};
+    using Sample = SpectralPixel::sample_t;
+    const auto trace_pixel = [&](const size_t row, const size_t col,
+                                 std::vector<Sample> &samples) {
+      const vec2 pixel = vec2(col + 0.5, row + 0.5);
+      const size_t pixel_index = row * image.m_width + col;
+      for (size_t i = 0; i < wavelengths.size(); ++i) {
+        const real wavelength = wavelengths[i];
         for (size_t sample = 0; sample < samples_per_pixel; ++sample) {
+          RNG random = RNG::for_sample(settings.seed, pixel_index,
+                                       i * samples_per_pixel + sample);
           const vec2 jitter = random.random_vec2(-0.5, 0.5);
-          const Ray ray = camera.get_ray(pixel + jitter, random);
-          const Colour colour = ray_colour(random, max_depth, ray);
-          image.add_pixel_sample(row, col, colour);
+          const Ray ray = camera.get_ray(pixel + jitter, random, wavelength);
+          const real intensity = get_intensity(random, max_depth, ray);
+          samples.emplace_back(wavelength, intensity);
         }
       }
-    }
-    image.template write_png<true>("output/progress.png");
+    };
+    render_tiles(image, settings, per_pixel(image, trace_pixel),
+                 [](const size_t) {});
   }
 
-  void render_spectral(const Camera &camera, SpectralImage &image,
-                       const size_t samples_per_pixel, const size_t max_depth) {
-    const auto wavelengths = std::vector<real>{550};
-    RNG random;
-    for (size_t row = 0; row < image.m_height; ++row) {
-      for (size_t col = 0; col < image.m_width; ++col) {
-        const vec2 pixel = vec2(col + 0.5, row + 0.5);
-        for (const real wavelength : wavelengths) {
-          for (size_t sample = 0; sample < samples_per_pixel; ++sample) {
-            const vec2 jitter = random.random_vec2(-0.5, 0.5);
-            const Ray ray = camera.get_ray(pixel + jitter, random, wavelength);
-            const real intensity = get_intensity(random, max_depth, ray);
-            image.add_pixel_sample(row, col, {wavelength, intensity});
-          }
+  // Renders in passes. The first pass gives every pixel the same number of
+  // samples; after each pass, only the pixels whose relative error is still
+  // above the target get more, doubling their sample count each time, until
+  // they converge, hit the per-pixel cap or the whole budget is spent.
+  template <typename Pixel>
+  void render_adaptive(const Camera &camera, OutputImage<Pixel> &image,
+                       const AdaptiveSettings &adaptive,
+                       const size_t max_depth,
+                       const RenderSettings &settings = RenderSettings()) {
+    const size_t num_pixels = image.m_width * image.m_height;
+    const size_t total_budget =
+        num_pixels * adaptive.average_samples_per_pixel;
+    RGBVarianceImage estimates(image.m_width, image.m_height);
+    std::vector<size_t> pass_samples(
+        num_pixels, std::min(adaptive.min_samples_per_pixel,
+                             adaptive.average_samples_per_pixel));
+    size_t samples_taken = 0;
+
+    Timer timer;
+    for (size_t pass = 0;; ++pass) {
+      size_t pass_total = 0;
+      for (const size_t samples : pass_samples)
+        pass_total += samples;
+      if (pass_total == 0)
+        break;
+
+      // Pixels take different numbers of samples, so each is traced as a
+      // tile of its own, with whichever integrator the settings choose
+      const auto trace_pixel = [&](const size_t row, const size_t col,
+                                   std::vector<Colour> &samples) {
+        const size_t idx = row * image.m_width + col;
+        if (pass_samples[idx] == 0)
+          return;
+        const Tile pixel_tile = {idx, row, row + 1, col, col + 1};
+        std::vector<Colour> colours;
+        trace_tile_colours(camera, settings, max_depth, image.m_width,
+                           pixel_tile, estimates.m_pixels[idx].m_num_samples,
+                           pass_samples[idx], colours);
+        for (const Colour &colour : colours) {
+          samples.push_back(colour);
+          // Only this tile's worker touches its pixels' estimates
+          estimates.add_pixel_sample(row, col, colour);
         }
+      };
+      render_tiles(image, settings, per_pixel(image, trace_pixel),
+                   [](const size_t) {});
+      samples_taken += pass_total;
+
+      // Choose which pixels to refine next, then scale the requests down
+      // evenly if they would overrun the budget
+      size_t num_active = 0, requested = 0;
+      for (size_t idx = 0; idx < num_pixels; ++idx) {
+        const RGBVariancePixel &pixel = estimates.m_pixels[idx];
+        const size_t num_samples = pixel.m_num_samples;
+        const bool active =
+            num_samples < adaptive.max_samples_per_pixel &&
+            pixel.relative_error() > adaptive.target_relative_error;
+        pass_samples[idx] =
+            active ? std::min(num_samples,
+                              adaptive.max_samples_per_pixel - num_samples)
+                   : 0;
+        num_active += active;
+        requested += pass_samples[idx];
+      }
+      const size_t remaining = total_budget - samples_taken;
+      if (requested > remaining) {
+        const real scale = static_cast<real>(remaining) / requested;
+        for (size_t &samples : pass_samples)
+          samples = static_cast<size_t>(samples * scale);
+      }
+
+      fmt::println("Pass {}: traced {} samples in {:.2f}s, {} / {} pixels "
+                   "still above target error",
+                   pass, pass_total, timer.elapsed_seconds(), num_active,
+                   num_pixels);
+      write_snapshot(image);
+    }
+
+    const real elapsed_seconds = timer.elapsed_seconds();
+    image_writer.write_png(image, {"output/progress.png", "output/result.png",
+                                   "public_output/result.png"});
+
+    fmt::println("Done! Took {:.2f} seconds, averaging {:.2f} samples per "
+                 "pixel.",
+                 elapsed_seconds,
+                 static_cast<real>(samples_taken) / num_pixels);
+  }
+
+  // Renders until the time budget runs out, one sample per pixel per pass (or
+  // a batch's worth for the wavefront integrator), so the whole image
+  // converges uniformly instead of row by row. The workers and their scheduler
+  // live for the whole render, and the scheduler spreads each pass over the
+  // image, so the pass cut short by the deadline doesn't shortchange one
+  // region. The deadline is checked before every tile, so it
+  // is overrun by at most one tile's worth of work.
+  template <typename Pixel>
+  TimedRenderResult render_for(const Camera &camera, OutputImage<Pixel> &image,
+                               const real time_budget_seconds,
+                               const size_t max_depth,
+                               const RenderSettings &settings =
+                                   RenderSettings()) {
+    // A Ctrl-C that stopped an earlier render must not stop this one
+    interrupt_requested.store(false);
+    const size_t num_pixels = image.m_width * image.m_height;
+    // Passes continue until trace_tile notices the deadline and stops them
+    TileScheduler scheduler(image.m_width, image.m_height, settings.tile_size,
+                            std::numeric_limits<size_t>::max());
+    // With fewer tiles than threads, two passes over a tile can overlap
+    std::vector<std::atomic<size_t>> tile_samples(scheduler.m_tiles.size());
+    size_t num_samples = 0;
+
+    Timer timer;
+    const auto out_of_time = [&]() {
+      return timer.elapsed_seconds() >= time_budget_seconds;
+    };
+    const auto on_tick = [&](const size_t) {
+      if (timer.seconds_since_last_update("progress_image") >= 1.0) {
+        timer.update("progress_image");
+        write_snapshot(image);
+      }
+    };
+    // One sample per pass keeps the deadline tight, but the wavefront
+    // integrator needs whole batches of paths to pay off, so it takes enough
+    // samples per pass to fill one
+    const auto samples_per_pass = [&](const Tile &tile) -> size_t {
+      if (settings.integrator != Integrator::Wavefront)
+        return 1;
+      return std::max<size_t>(1, WavefrontIntegrator::max_batch_size /
+                                     tile.num_pixels());
+    };
+    const auto trace_tile = [&](const Tile &tile) -> size_t {
+      if (out_of_time()) {
+        scheduler.stop();
+        return 0;
       }
+      const size_t num_tile_samples = samples_per_pass(tile);
+      tile_samples[tile.index].fetch_add(num_tile_samples,
+                                         std::memory_order_relaxed);
+      return trace_samples(camera, image, settings, max_depth, tile,
+                           tile.pass * num_tile_samples, num_tile_samples);
+    };
+    render_tiles(scheduler, settings, trace_tile, on_tick);
+
+    TimedRenderResult result;
+    result.samples_per_pixel.resize(num_pixels);
+    for (const Tile &tile : scheduler.m_tiles)
+      for (size_t row = tile.row_begin; row < tile.row_end; ++row)
+        for (size_t col = tile.col_begin; col < tile.col_end; ++col)
+          result.samples_per_pixel[row * image.m_width + col] =
+              tile_samples[tile.index];
+    for (const size_t samples : result.samples_per_pixel)
+      num_samples += samples;
+    result.min_samples_per_pixel = *std::min_element(
+        result.samples_per_pixel.begin(), result.samples_per_pixel.end());
+    result.max_samples_per_pixel = *std::max_element(
+        result.samples_per_pixel.begin(), result.samples_per_pixel.end());
+    result.average_samples_per_pixel =
+        static_cast<real>(num_samples) / num_pixels;
+
+    image_writer.write_png(image, {"output/progress.png", "output/result.png",
+                                   "public_output/result.png"});
+    fmt::println("Done! Took {:.2f} of {:.2f} seconds for {:.2f} samples per "
+                 "pixel (min {}, max {})",
+                 timer.elapsed_seconds(), time_budget_seconds,
+                 result.average_samples_per_pixel,
+                 result.min_samples_per_pixel, result.max_samples_per_pixel);
+    return result;
+  }
+
+  // Traces the given sample of a pixel along its own RNG stream, so the result
+  // only depends on the seed, the pixel and the sample index
+  inline Colour sample_pixel(const Camera &camera,
+                             const RenderSettings &settings,
+                             const size_t max_depth, const size_t image_width,
+                             const size_t row, const size_t col,
+                             const size_t sample) const {
+    RNG random =
+        RNG::for_sample(settings.seed, row * image_width + col, sample);
+    const vec2 pixel = vec2(col + 0.5, row + 0.5);
+    const vec2 jitter = random.random_vec2(-0.5, 0.5);
+    const Ray ray = camera.get_ray(pixel + jitter, random);
+    return ray_colour(random, max_depth, ray);
+  }
+
+  // Traces samples [first_sample, first_sample + num_samples) of every pixel
+  // in the tile with the integrator chosen in the settings. colours is filled
+  // in row-major pixel order, with the samples of each pixel stored
+  // contiguously.
+  void trace_tile_colours(const Camera &camera, const RenderSettings &settings,
+                          const size_t max_depth, const size_t image_width,
+                          const Tile &tile, const size_t first_sample,
+                          const size_t num_samples,
+                          std::vector<Colour> &colours) const;
+
+  // Traces a tile with trace_tile_colours, then adds the samples to the image
+  // in sample order while holding image_mutex
+  template <typename Pixel>
+  size_t trace_samples(const Camera &camera, OutputImage<Pixel> &image,
+                       const RenderSettings &settings, const size_t max_depth,
+                       const Tile &tile, const size_t first_sample,
+                       const size_t num_samples) const {
+    std::vector<Colour> colours;
+    trace_tile_colours(camera, settings, max_depth, image.m_width, tile,
+                       first_sample, num_samples, colours);
+
+    // Commit the whole tile at once, so snapshots and checkpoints taken under
+    // the same lock only ever see finished tiles
+    std::lock_guard lock(image_mutex);
+    size_t idx = 0;
+    for (size_t row = tile.row_begin; row < tile.row_end; ++row)
+      for (size_t col = tile.col_begin; col < tile.col_end; ++col)
+        for (size_t i = 0; i < num_samples; ++i)
+          image.add_pixel_sample(row, col, colours[idx++]);
+    return tile.num_pixels() * num_samples;
+  }
+
+  // Splits the image into tiles and traces them on settings.num_threads
+  // worker threads. trace_tile(tile) takes every sample for the pixels in one
+  // tile and returns how many it took. Meanwhile, the calling thread invokes
+  // on_tick(samples_so_far) every few milliseconds, so progress updates never
+  // steal time from the workers.
+  //
+  // Each pixel belongs to exactly one tile, so workers never write to the same
+  // pixel. on_tick runs concurrently with the workers, so trace_tile must add
+  // its samples to the image while holding image_mutex, and anything on_tick
+  // reads from the image must take the same lock; trace_samples and per_pixel
+  // both commit whole tiles that way.
+  //
+  // Once interrupt_requested is set, workers stop picking up new tiles.
+  template <typename Pixel, typename TraceTile, typename OnTick>
+  void render_tiles(OutputImage<Pixel> &image, const RenderSettings &settings,
+                    const TraceTile &trace_tile, const OnTick &on_tick) const {
+    TileScheduler scheduler(image.m_width, image.m_height, settings.tile_size);
+    render_tiles(scheduler, settings, trace_tile, on_tick);
+  }
+
+  // Like render_tiles above, but draws tiles from the given scheduler, which
+  // may hand out several passes over the image
+  template <typename TraceTile, typename OnTick>
+  void render_tiles(TileScheduler &scheduler, const RenderSettings &settings,
+                    const TraceTile &trace_tile, const OnTick &on_tick) const {
+    debug_assert(settings.num_threads > 0, "Need at least one render thread");
+    std::atomic<size_t> num_samples = 0;
+    std::atomic<size_t> num_running = settings.num_threads;
+    std::mutex done_mutex;
+    std::condition_variable done;
+
+    const auto worker = [&]() {
+      while (!interrupt_requested.load(std::memory_order_relaxed)) {
+        const auto tile = scheduler.next();
+        if (!tile.has_value())
+          break;
+        const size_t samples = trace_tile(*tile);
+        num_samples.fetch_add(samples, std::memory_order_relaxed);
+      }
+      if (num_running.fetch_sub(1, std::memory_order_release) == 1) {
+        std::lock_guard lock(done_mutex);
+        done.notify_all();
+      }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(settings.num_threads);
+    for (size_t i = 0; i < settings.num_threads; ++i)
+      workers.emplace_back(worker);
+
+    // Wake up early when the last worker finishes, so short renders don't
+    // wait out a whole tick
+    std::unique_lock lock(done_mutex);
+    while (!done.wait_for(lock, std::chrono::milliseconds(10), [&]() {
+      return num_running.load(std::memory_order_acquire) == 0;
+    })) {
+      lock.unlock();
+      on_tick(num_samples.load(std::memory_order_relaxed));
+      lock.lock();
     }
+    lock.unlock();
+    for (auto &thread : workers)
+      thread.join();
+    on_tick(num_samples.load());
   }
 };
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "util/util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+struct Tile {
+  size_t index;
+  size_t row_begin, row_end;
+  size_t col_begin, col_end;
+  // Which of the scheduler's passes over the image this tile belongs to
+  size_t pass = 0;
+
+  constexpr inline size_t num_pixels() const {
+    return (row_end - row_begin) * (col_end - col_begin);
+  }
+};
+
+// Splits an image into square tiles and hands them out to worker threads on
+// demand, so threads that draw cheap tiles (e.g. sky) simply take more of them.
+// Every tile is handed out once per pass, for num_passes passes. Within a pass,
+// tiles are visited with a golden-ratio stride rather than row by row, so if
+// the render stops early the finished tiles are spread over the whole image;
+// each pass also starts from a different tile. After stop(), no more tiles are
+// handed out.
+struct TileScheduler {
+  std::vector<Tile> m_tiles;
+  std::atomic<size_t> m_next_tile = 0;
+  std::atomic<bool> m_stopped = false;
+  size_t m_num_passes = 1;
+  size_t m_stride = 1;
+
+  TileScheduler(const size_t width, const size_t height, const size_t tile_size,
+                const size_t num_passes = 1)
+      : m_num_passes(num_passes) {
+    debug_assert(tile_size > 0, "Tile size must be positive");
+    for (size_t row = 0; row < height; row += tile_size) {
+      for (size_t col = 0; col < width; col += tile_size) {
+        const size_t row_end = std::min(row + tile_size, height);
+        const size_t col_end = std::min(col + tile_size, width);
+        m_tiles.push_back({m_tiles.size(), row, row_end, col, col_end});
+      }
+    }
+    // The stride must be coprime with the tile count to visit every tile
+    if (m_tiles.empty())
+      return;
+    m_stride = std::max<size_t>(1, 0.618034 * m_tiles.size());
+    while (std::gcd(m_stride, m_tiles.size()) != 1)
+      ++m_stride;
+  }
+
+  inline std::optional<Tile> next() {
+    if (m_tiles.empty() || m_stopped.load(std::memory_order_relaxed))
+      return std::nullopt;
+    const size_t idx = m_next_tile.fetch_add(1, std::memory_order_relaxed);
+    const size_t pass = idx / m_tiles.size();
+    if (pass >= m_num_passes)
+      return std::nullopt;
+    const size_t step = (idx + pass) % m_tiles.size();
+    Tile tile = m_tiles[step * m_stride % m_tiles.size()];
+    tile.pass = pass;
+    return tile;
+  }
+
+  inline void stop() { m_stopped.store(true, std::memory_order_relaxed); }
+};
+
+inline size_t num_tiles(const size_t width, const size_t height,
+                        const size_t tile_size) {
+  return ((width + tile_size - 1) / tile_size) *
+         ((height + tile_size - 1) / tile_size);
+}
@@ -0,0 +1,140 @@
+#include "wavefront.hpp"
+
+#include "scene/scene.hpp"
+
+#include <utility>
+
+void WavefrontIntegrator::trace_tile(const Tile &tile,
+                                     const size_t first_sample,
+                                     const size_t num_samples,
+                                     std::vector<Colour> &colours) {
+  const size_t total_paths = tile.num_pixels() * num_samples;
+  colours.assign(total_paths, Colour(0.0, 0.0, 0.0));
+
+  for (size_t first_path = 0; first_path < total_paths;
+       first_path += max_batch_size) {
+    const size_t num_paths =
+        std::min(max_batch_size, total_paths - first_path);
+    generate(tile, first_sample, num_samples, first_path, num_paths);
+
+    // Paths still alive after the last bounce contribute nothing, just like
+    // Scene::ray_colour, so their colours stay black
+    for (size_t depth = 0; depth < m_max_depth && !m_path_ids.empty();
+         ++depth) {
+      intersect();
+      queue_by_material(colours);
+      [&]<size_t... Is>(std::index_sequence<Is...>) {
+        (shade<Is>(colours), ...);
+      }(std::make_index_sequence<num_materials>());
+      compact();
+    }
+  }
+}
+
+void WavefrontIntegrator::generate(const Tile &tile, const size_t first_sample,
+                                   const size_t num_samples,
+                                   const size_t first_path,
+                                   const size_t num_paths) {
+  m_origins.resize(num_paths);
+  m_directions.resize(num_paths);
+  m_throughputs.assign(num_paths, Colour(1.0, 1.0, 1.0));
+  m_randoms.resize(num_paths);
+  m_path_ids.resize(num_paths);
+
+  const size_t tile_width = tile.col_end - tile.col_begin;
+  for (size_t slot = 0; slot < num_paths; ++slot) {
+    const size_t path = first_path + slot;
+    const size_t pixel_in_tile = path / num_samples;
+    const size_t row = tile.row_begin + pixel_in_tile / tile_width;
+    const size_t col = tile.col_begin + pixel_in_tile % tile_width;
+    const size_t sample = first_sample + path % num_samples;
+
+    RNG random =
+        RNG::for_sample(m_seed, row * m_image_width + col, sample);
+    const vec2 pixel = vec2(col + 0.5, row + 0.5);
+    const vec2 jitter = random.random_vec2(-0.5, 0.5);
+    const Ray ray = m_camera->get_ray(pixel + jitter, random);
+
+    m_origins[slot] = ray.origin;
+    m_directions[slot] = ray.direction;
+    m_randoms[slot] = random;
+    m_path_ids[slot] = path;
+  }
+}
+
+void WavefrontIntegrator::intersect() {
+  const size_t num_live = m_path_ids.size();
+  m_records.assign(num_live, HitRecord());
+  m_alive.resize(num_live);
+  for (size_t slot = 0; slot < num_live; ++slot)
+    m_alive[slot] =
+        m_scene->world.hit(load_ray(slot), 0.0001, INFINITY, m_records[slot]);
+}
+
+void WavefrontIntegrator::queue_by_material(std::vector<Colour> &colours) {
+  for (auto &queue : m_queues)
+    queue.clear();
+
+  for (size_t slot = 0; slot < m_path_ids.size(); ++slot) {
+    if (!m_alive[slot]) {
+      colours[m_path_ids[slot]] =
+          m_throughputs[slot] * m_scene->get_background_colour(load_ray(slot));
+      continue;
+    }
+
+    const Material::MaterialVariant &material =
+        m_records[slot].material->material;
+    const size_t texture_idx = std::visit(
+        [](const auto &material) { return material.albedo.texture.index(); },
+        material);
+    m_queues[material.index() * num_textures + texture_idx].push_back(slot);
+  }
+}
+
+template <size_t material_idx>
+void WavefrontIntegrator::shade(std::vector<Colour> &colours) {
+  using MaterialType =
+      std::variant_alternative_t<material_idx, Material::MaterialVariant>;
+
+  for (size_t texture_idx = 0; texture_idx < num_textures; ++texture_idx) {
+    for (const uint32_t slot : m_queues[material_idx * num_textures +
+                                        texture_idx]) {
+      const HitRecord &record = m_records[slot];
+      const MaterialType &material =
+          *std::get_if<MaterialType>(&record.material->material);
+
+      Ray scattered;
+      Colour attenuation;
+      if (!material.scatter(m_randoms[slot], load_ray(slot), record,
+                            attenuation, scattered)) {
+        colours[m_path_ids[slot]] = Colour(0.0, 0.0, 0.0);
+        m_alive[slot] = false;
+        continue;
+      }
+
+      m_throughputs[slot] *= attenuation;
+      m_origins[slot] = scattered.origin;
+      m_directions[slot] = scattered.direction;
+    }
+  }
+}
+
+void WavefrontIntegrator::compact() {
+  size_t num_live = 0;
+  for (size_t slot = 0; slot < m_path_ids.size(); ++slot) {
+    if (!m_alive[slot])
+      continue;
+    m_origins[num_live] = m_origins[slot];
+    m_directions[num_live] = m_directions[slot];
+    m_throughputs[num_live] = m_throughputs[slot];
+    m_randoms[num_live] = m_randoms[slot];
+    m_path_ids[num_live] = m_path_ids[slot];
+    ++num_live;
+  }
+
+  m_origins.resize(num_live);
+  m_directions.resize(num_live);
+  m_throughputs.resize(num_live);
+  m_randoms.resize(num_live);
+  m_path_ids.resize(num_live);
+}
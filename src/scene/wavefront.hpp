@@ -0,0 +1,98 @@
+#pragma once
+
+#include "materials/material.hpp"
+#include "objects/hit_record.hpp"
+#include "scene/camera.hpp"
+#include "scene/tile_scheduler.hpp"
+#include "util/random.hpp"
+#include "util/util.hpp"
+
+#include <array>
+#include <variant>
+#include <vector>
+
+struct Scene;
+
+// Traces a batch of camera paths breadth-first, as an alternative to
+// Scene::ray_colour's one-path-at-a-time loop. Each bounce runs as separate
+// stages over the whole batch:
+//   1. intersect every live path with the scene,
+//   2. resolve misses and queue hits by (material, texture) alternative,
+//   3. shade each queue with its statically-known material type,
+//   4. compact the surviving paths for the next bounce.
+// Path state is kept in parallel arrays so every stage streams through
+// memory, and each shading loop runs a single scatter() implementation.
+//
+// Every path draws from the same RNG stream as Scene::sample_pixel, so both
+// integrators produce identical images.
+//
+// The path arrays only ever grow, so a worker thread keeps one integrator and
+// rebinds it to each render with bind(), instead of reallocating them per
+// tile.
+struct WavefrontIntegrator {
+  static constexpr size_t max_batch_size = 1 << 14;
+  static constexpr size_t num_materials =
+      std::variant_size_v<Material::MaterialVariant>;
+  static constexpr size_t num_textures =
+      std::variant_size_v<Texture::TextureVariant>;
+  static constexpr size_t num_shading_queues = num_materials * num_textures;
+
+  const Scene *m_scene = nullptr;
+  const Camera *m_camera = nullptr;
+  size_t m_max_depth = 0;
+  uint64_t m_seed = 0;
+  size_t m_image_width = 0;
+
+  // Live path state, indexed by slot; m_path_ids maps a slot to its path
+  std::vector<vec3> m_origins, m_directions;
+  std::vector<Colour> m_throughputs;
+  std::vector<RNG> m_randoms;
+  std::vector<uint32_t> m_path_ids;
+  std::vector<HitRecord> m_records;
+  std::vector<uint8_t> m_alive;
+
+  // Slots that hit something, grouped by the material and texture they hit
+  std::array<std::vector<uint32_t>, num_shading_queues> m_queues;
+
+  WavefrontIntegrator() = default;
+  WavefrontIntegrator(const Scene &scene, const Camera &camera,
+                      const size_t max_depth, const uint64_t seed,
+                      const size_t image_width) {
+    bind(scene, camera, max_depth, seed, image_width);
+  }
+
+  // Points the integrator at another render, keeping its buffers
+  inline void bind(const Scene &scene, const Camera &camera,
+                   const size_t max_depth, const uint64_t seed,
+                   const size_t image_width) {
+    m_scene = &scene;
+    m_camera = &camera;
+    m_max_depth = max_depth;
+    m_seed = seed;
+    m_image_width = image_width;
+  }
+
+  // Traces samples [first_sample, first_sample + num_samples) of every pixel
+  // in the tile. colours is filled in row-major pixel order, with the samples
+  // of each pixel stored contiguously.
+  void trace_tile(const Tile &tile, const size_t first_sample,
+                  const size_t num_samples, std::vector<Colour> &colours);
+
+private:
+  void generate(const Tile &tile, const size_t first_sample,
+                const size_t num_samples, const size_t first_path,
+                const size_t num_paths);
+  void intersect();
+  void queue_by_material(std::vector<Colour> &colours);
+  template <size_t material_idx> void shade(std::vector<Colour> &colours);
+  void compact();
+
+  inline Ray load_ray(const size_t slot) const {
+    // Directions are already normalized: copy them so every bit matches the
+    // reference integrator
+    Ray ray;
+    ray.origin = m_origins[slot];
+    ray.direction = m_directions[slot];
+    return ray;
+  }
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "util/util.hpp"
+
+#include <istream>
+#include <ostream>
+#include <type_traits>
+
+// Raw little helpers for the binary formats the renderer writes. Reals are
+// always stored as doubles, so files don't depend on the precision of `real`.
+
+template <typename T> inline void write_binary(std::ostream &os, const T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  if constexpr (std::is_floating_point_v<T>) {
+    const double wide = value;
+    os.write(reinterpret_cast<const char *>(&wide), sizeof(wide));
+  } else {
+    os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+}
+
+template <typename T> inline void read_binary(std::istream &is, T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  if constexpr (std::is_floating_point_v<T>) {
+    double wide;
+    is.read(reinterpret_cast<char *>(&wide), sizeof(wide));
+    value = wide;
+  } else {
+    is.read(reinterpret_cast<char *>(&value), sizeof(value));
+  }
+  if (!is)
+    throw std::runtime_error("Unexpected end of binary file");
+}
+
+inline void write_binary(std::ostream &os, const vec3 &value) {
+  write_binary(os, value.x);
+  write_binary(os, value.y);
+  write_binary(os, value.z);
+}
+
+inline void read_binary(std::istream &is, vec3 &value) {
+  read_binary(is, value.x);
+  read_binary(is, value.y);
+  read_binary(is, value.z);
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "util/binary_io.hpp"
+#include "util/output_image.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Binary snapshot of an image's accumulators, along with everything needed to
+// keep drawing the same RNG streams: every pixel's sample count is stored in
+// the pixel itself, so the seed, the first sample index and the tile layout
+// complete the picture.
+//
+// Layout: magic, version, CheckpointInfo fields, then width * height pixels in
+// row-major order, each written by Pixel::write_binary.
+constexpr std::array<char, 8> checkpoint_magic = {'S', 'P', 'E', 'C',
+                                                  'C', 'K', 'P', 'T'};
+constexpr uint32_t checkpoint_version = 3;
+
+struct CheckpointInfo {
+  uint32_t pixel_type = 0;
+  uint64_t width = 0, height = 0;
+  uint64_t tile_size = 0;
+  uint64_t seed = 0;
+  uint64_t first_sample = 0;
+};
+
+// Writes to a temporary file first and renames it into place once it is
+// safely on disk, so a crash or a failed write never destroys the previous
+// checkpoint. Throws if the checkpoint could not be written.
+template <typename Pixel>
+void save_checkpoint(const std::string &path, const OutputImage<Pixel> &image,
+                     const uint64_t tile_size, const uint64_t seed,
+                     const uint64_t first_sample) {
+  std::ostringstream os(std::ios::binary);
+  os.write(checkpoint_magic.data(), checkpoint_magic.size());
+  write_binary(os, checkpoint_version);
+  write_binary(os, Pixel::type_id);
+  write_binary<uint64_t>(os, image.m_width);
+  write_binary<uint64_t>(os, image.m_height);
+  write_binary(os, tile_size);
+  write_binary(os, seed);
+  write_binary(os, first_sample);
+  for (const Pixel &pixel : image.m_pixels)
+    pixel.write_binary(os);
+  const std::string bytes = std::move(os).str();
+
+  // The temporary file is unique, so shards checkpointing into the same
+  // directory never write into each other's
+  std::string temp_path = path + ".XXXXXX";
+  const int fd = ::mkstemp(temp_path.data());
+  if (fd < 0)
+    throw std::runtime_error(
+        fmt::format("Could not open checkpoint '{}' for writing", path));
+  const auto write_all = [&]() {
+    const char *data = bytes.data();
+    size_t size = bytes.size();
+    while (size > 0) {
+      const ssize_t n = ::write(fd, data, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      data += n;
+      size -= n;
+    }
+    return true;
+  };
+  // The data must reach the disk before the rename, or a crash could leave
+  // the new name pointing at a partial file
+  bool written = ::fchmod(fd, 0644) == 0 && write_all() && ::fsync(fd) == 0;
+  written = ::close(fd) == 0 && written;
+  std::error_code error;
+  if (written)
+    std::filesystem::rename(temp_path, path, error);
+  if (!written || error) {
+    std::filesystem::remove(temp_path, error);
+    throw std::runtime_error(
+        fmt::format("Could not write checkpoint '{}'", path));
+  }
+}
+
+inline CheckpointInfo read_checkpoint_info(std::istream &is,
+                                           const std::string &path) {
+  std::array<char, 8> magic;
+  is.read(magic.data(), magic.size());
+  uint32_t version = 0;
+  if (is)
+    read_binary(is, version);
+  if (magic != checkpoint_magic || version != checkpoint_version)
+    throw std::runtime_error(
+        fmt::format("'{}' is not a version {} checkpoint", path,
+                    checkpoint_version));
+
+  CheckpointInfo info;
+  read_binary(is, info.pixel_type);
+  read_binary(is, info.width);
+  read_binary(is, info.height);
+  read_binary(is, info.tile_size);
+  read_binary(is, info.seed);
+  read_binary(is, info.first_sample);
+  return info;
+}
+
+// Replaces the image's accumulators with the checkpoint's. Returns nullopt if
+// there is no checkpoint at path, and throws if it doesn't fit the image.
+template <typename Pixel>
+std::optional<CheckpointInfo> load_checkpoint(const std::string &path,
+                                              OutputImage<Pixel> &image) {
+  std::ifstream is(path, std::ios::binary);
+  if (!is)
+    return std::nullopt;
+
+  const CheckpointInfo info = read_checkpoint_info(is, path);
+  if (info.pixel_type != Pixel::type_id || info.width != image.m_width ||
+      info.height != image.m_height)
+    throw std::runtime_error(fmt::format(
+        "Checkpoint '{}' holds a {}x{} image of pixel type {}, expected {}x{} "
+        "of type {}",
+        path, info.width, info.height, info.pixel_type, image.m_width,
+        image.m_height, Pixel::type_id));
+
+  for (Pixel &pixel : image.m_pixels)
+    pixel.read_binary(is);
+  return info;
+}
+
+// Reads just the header of the checkpoint at path, or nullopt if it can't be
+// opened
+inline std::optional<CheckpointInfo>
+peek_checkpoint_info(const std::string &path) {
+  std::ifstream is(path, std::ios::binary);
+  if (!is)
+    return std::nullopt;
+  return read_checkpoint_info(is, path);
+}
+
+// A checkpoint merged into an image, holding samples [first_sample,
+// end_sample) of its pixels
+struct MergedCheckpoint {
+  CheckpointInfo info;
+  uint64_t end_sample = 0;
+};
+
+// Adds the samples of the checkpoint at path to the image, weighting each
+// pixel by its sample count, and records it in merged. Returns false if there
+// is no checkpoint at path. Throws, leaving the image untouched, if the
+// checkpoint's RNG streams don't belong with those already merged: its seed
+// and tile size must match the first merged checkpoint's, and its samples
+// must not overlap any merged checkpoint's, or they would be counted twice.
+template <typename Pixel>
+bool merge_checkpoint(const std::string &path, OutputImage<Pixel> &image,
+                      std::vector<MergedCheckpoint> &merged) {
+  OutputImage<Pixel> shard(image.m_width, image.m_height);
+  const auto info = load_checkpoint(path, shard);
+  if (!info.has_value())
+    return false;
+
+  if (!merged.empty() && (info->seed != merged.front().info.seed ||
+                          info->tile_size != merged.front().info.tile_size))
+    throw std::runtime_error(fmt::format(
+        "seed {} and tile size {} differ from the first shard's {} and {}",
+        info->seed, info->tile_size, merged.front().info.seed,
+        merged.front().info.tile_size));
+
+  // Tiles are committed whole, so no pixel holds samples past the fullest one
+  uint64_t num_samples = 0;
+  for (const Pixel &pixel : shard.m_pixels)
+    num_samples = std::max<uint64_t>(num_samples, pixel.num_samples());
+  const uint64_t end_sample = info->first_sample + num_samples;
+  for (const MergedCheckpoint &other : merged)
+    if (num_samples > 0 && info->first_sample < other.end_sample &&
+        other.info.first_sample < end_sample)
+      throw std::runtime_error(fmt::format(
+          "samples [{}, {}) overlap samples [{}, {}) of an earlier shard",
+          info->first_sample, end_sample, other.info.first_sample,
+          other.end_sample));
+
+  image.merge(shard);
+  merged.push_back({*info, end_sample});
+  return true;
+}
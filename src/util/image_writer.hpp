@@ -0,0 +1,101 @@
+#pragma once
+
+#include "util/output_image.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Converts and encodes PNGs on a background thread, so writing an image only
+// costs the caller a copy of its accumulators. Queued writes finish before
+// the writer is destroyed, so they can overlap with whatever the program does
+// next, including tearing down the scene.
+struct AsyncImageWriter {
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::deque<std::function<void()>> m_jobs;
+  bool m_busy = false;
+  bool m_stopping = false;
+  std::thread m_thread;
+
+  AsyncImageWriter() : m_thread([this]() { run(); }) {}
+  ~AsyncImageWriter() {
+    {
+      std::lock_guard lock(m_mutex);
+      m_stopping = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+  }
+
+  AsyncImageWriter(const AsyncImageWriter &) = delete;
+  AsyncImageWriter &operator=(const AsyncImageWriter &) = delete;
+
+  // Queues the image to be written to every file in filenames, encoding it
+  // only once
+  template <bool gamma_correct = true, typename Pixel>
+  void write_png(const OutputImage<Pixel> &image,
+                 const std::vector<std::string> &filenames) {
+    std::lock_guard lock(m_mutex);
+    m_jobs.push_back(make_job<gamma_correct>(image, filenames));
+    m_condition.notify_all();
+  }
+
+  // Like write_png, but drops the snapshot if the previous write has not
+  // finished yet, so a slow encoder never builds up a backlog. Returns whether
+  // the snapshot was queued.
+  template <bool gamma_correct = true, typename Pixel>
+  bool write_snapshot_png(const OutputImage<Pixel> &image,
+                          const std::string &filename) {
+    {
+      std::lock_guard lock(m_mutex);
+      if (m_busy || !m_jobs.empty())
+        return false;
+    }
+    write_png<gamma_correct>(image, {filename});
+    return true;
+  }
+
+  // Blocks until every queued write has finished
+  void wait() {
+    std::unique_lock lock(m_mutex);
+    m_condition.wait(lock, [this]() { return !m_busy && m_jobs.empty(); });
+  }
+
+private:
+  template <bool gamma_correct, typename Pixel>
+  static std::function<void()>
+  make_job(const OutputImage<Pixel> &image,
+           const std::vector<std::string> &filenames) {
+    const auto snapshot = std::make_shared<const OutputImage<Pixel>>(image);
+    return [snapshot, filenames]() {
+      const std::vector<uint8_t> bytes =
+          snapshot->template to_rgb_bytes<gamma_correct>();
+      for (const std::string &filename : filenames)
+        snapshot->write_png_bytes(filename, bytes);
+    };
+  }
+
+  void run() {
+    std::unique_lock lock(m_mutex);
+    while (true) {
+      m_condition.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+      if (m_jobs.empty())
+        return;
+
+      std::function<void()> job = std::move(m_jobs.front());
+      m_jobs.pop_front();
+      m_busy = true;
+      lock.unlock();
+      job();
+      lock.lock();
+      m_busy = false;
+      m_condition.notify_all();
+    }
+  }
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <atomic>
+#include <csignal>
+
+// Set by SIGINT / SIGTERM once install_interrupt_handlers() has run, so long
+// renders can stop cleanly and checkpoint instead of dying mid-write
+inline std::atomic<bool> interrupt_requested = false;
+static_assert(std::atomic<bool>::is_always_lock_free,
+              "interrupt_requested is written from a signal handler");
+
+inline void install_interrupt_handlers() {
+  const auto handler = [](int) { interrupt_requested.store(true); };
+  std::signal(SIGINT, handler);
+  std::signal(SIGTERM, handler);
+}
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include "util/binary_io.hpp"
 #include "util/cmf.hpp"
 #include "util/piecewise_linear.hpp"
 #include "util/util.hpp"
@@ -18,6 +19,15 @@ template <typename T> struct AverageWrapper {
     m_value += (sample - m_value) / m_num_samples;
   }
   constexpr inline T get_value() const { return m_value; }
+
+  constexpr inline void merge(const AverageWrapper &other) {
+    const size_t total = m_num_samples + other.m_num_samples;
+    if (total == 0)
+      return;
+    const real weight = static_cast<real>(other.m_num_samples) / total;
+    m_value += (other.m_value - m_value) * weight;
+    m_num_samples = total;
+  }
 };
 
 constexpr inline real gamma_correct_real(const real d) {
@@ -68,10 +78,20 @@ template <typename Pixel> struct OutputImage {
     m_pixels[row * m_width + col].add_sample(sample);
   }
 
+  // Combines another render of the same pixels, such as a different sample
+  // range of the same frame, into this one
+  void merge(const OutputImage &other) {
+    debug_assert(m_width == other.m_width && m_height == other.m_height,
+                 "Cannot merge a {}x{} image into a {}x{} one", other.m_width,
+                 other.m_height, m_width, m_height);
+    for (size_t i = 0; i < m_pixels.size(); ++i)
+      m_pixels[i].merge(other.m_pixels[i]);
+  }
+
   // TODO: Consider allowing global tone-mapping:
   // https://64.github.io/tonemapping
   template <bool gamma_correct = true>
-  void write_png(const std::string_view &filename) const {
+  std::vector<uint8_t> to_rgb_bytes() const {
     std::vector<uint8_t> gamma_corrected_data(3 * m_width * m_height);
     for (size_t i = 0; i < m_width * m_height; ++i) {
       const RGBByte rgb_pixel =
@@ -80,9 +100,18 @@ template <typename Pixel> struct OutputImage {
       gamma_corrected_data[3 * i + 1] = rgb_pixel[1];
       gamma_corrected_data[3 * i + 2] = rgb_pixel[2];
     }
+    return gamma_corrected_data;
+  }
+
+  template <bool gamma_correct = true>
+  void write_png(const std::string_view &filename) const {
+    write_png_bytes(filename, to_rgb_bytes<gamma_correct>());
+  }
 
+  void write_png_bytes(const std::string_view &filename,
+                       const std::vector<uint8_t> &rgb_bytes) const {
     const int result = stbi_write_png(filename.data(), m_width, m_height, 3,
-                                      gamma_corrected_data.data(), 3 * m_width);
+                                      rgb_bytes.data(), 3 * m_width);
     debug_assert(result != 0, "write_png({}) failed: is the location writable?",
                  filename);
   }
@@ -91,23 +120,44 @@ template <typename Pixel> struct OutputImage {
 struct RGBPixel {
   using sample_t = Colour;
   Colour m_mean = Colour(0.0, 0.0, 0.0);
-  real m_num_samples = 0;
+  // Counted exactly, so the mean keeps its weight in single-precision builds
+  uint64_t m_num_samples = 0;
 
   constexpr RGBPixel() = default;
 
   constexpr inline void add_sample(const sample_t &_sample) {
     const Colour sample = remove_nans(_sample);
     m_num_samples += 1;
-    m_mean += (sample - m_mean) / m_num_samples;
+    m_mean += (sample - m_mean) / static_cast<real>(m_num_samples);
   }
   constexpr inline Colour to_pixel() const { return m_mean; }
+  constexpr inline size_t num_samples() const { return m_num_samples; }
+
+  constexpr inline void merge(const RGBPixel &other) {
+    const uint64_t total = m_num_samples + other.m_num_samples;
+    if (total == 0)
+      return;
+    const real weight = static_cast<real>(other.m_num_samples) / total;
+    m_mean += (other.m_mean - m_mean) * weight;
+    m_num_samples = total;
+  }
+
+  static constexpr uint32_t type_id = 1;
+  void write_binary(std::ostream &os) const {
+    ::write_binary(os, m_mean);
+    ::write_binary(os, m_num_samples);
+  }
+  void read_binary(std::istream &is) {
+    ::read_binary(is, m_mean);
+    ::read_binary(is, m_num_samples);
+  }
 };
 
 struct RGBVariancePixel {
   using sample_t = Colour;
   Colour m_mean = Colour(0.0, 0.0, 0.0);
   Colour m_variance = Colour(0.0, 0.0, 0.0);
-  real m_num_samples = 0;
+  uint64_t m_num_samples = 0;
 
   constexpr RGBVariancePixel() = default;
 
@@ -115,13 +165,62 @@ struct RGBVariancePixel {
     const Colour sample = remove_nans(_sample);
     const Colour old_mean = m_mean;
     m_num_samples += 1;
-    m_mean += (sample - m_mean) / m_num_samples;
+    m_mean += (sample - m_mean) / static_cast<real>(m_num_samples);
     m_variance += (sample - old_mean) * (sample - m_mean);
   }
   constexpr inline Colour to_pixel() const {
     if (m_num_samples == 0)
       return Colour(0.0, 0.0, 0.0);
-    return m_variance / m_num_samples;
+    return m_variance / static_cast<real>(m_num_samples);
+  }
+
+  constexpr inline Colour get_mean() const { return m_mean; }
+
+  // Unbiased estimate of the variance of a single sample
+  constexpr inline Colour sample_variance() const {
+    if (m_num_samples < 2)
+      return Colour(0.0, 0.0, 0.0);
+    return m_variance / static_cast<real>(m_num_samples - 1);
+  }
+
+  // Standard error of the mean, relative to the pixel's brightness. The small
+  // constant keeps near-black pixels from demanding unbounded samples.
+  inline real relative_error() const {
+    if (m_num_samples < 2)
+      return INFINITY;
+    const Colour variance_of_mean =
+        sample_variance() / static_cast<real>(m_num_samples);
+    const real standard_error =
+        std::sqrt(variance_of_mean.r) + std::sqrt(variance_of_mean.g) +
+        std::sqrt(variance_of_mean.b);
+    const real brightness = m_mean.r + m_mean.g + m_mean.b;
+    return standard_error / (brightness + 1e-3);
+  }
+  constexpr inline size_t num_samples() const { return m_num_samples; }
+
+  // Chan et al.'s pairwise update, so merged variances stay exact
+  constexpr inline void merge(const RGBVariancePixel &other) {
+    const uint64_t total = m_num_samples + other.m_num_samples;
+    if (total == 0)
+      return;
+    const real weight = static_cast<real>(other.m_num_samples) / total;
+    const Colour delta = other.m_mean - m_mean;
+    m_mean += delta * weight;
+    m_variance += other.m_variance +
+                  delta * delta * (static_cast<real>(m_num_samples) * weight);
+    m_num_samples = total;
+  }
+
+  static constexpr uint32_t type_id = 2;
+  void write_binary(std::ostream &os) const {
+    ::write_binary(os, m_mean);
+    ::write_binary(os, m_variance);
+    ::write_binary(os, m_num_samples);
+  }
+  void read_binary(std::istream &is) {
+    ::read_binary(is, m_mean);
+    ::read_binary(is, m_variance);
+    ::read_binary(is, m_num_samples);
   }
 };
 
@@ -145,6 +244,42 @@ struct SpectralPixel {
     m_samples[sample.wavelength].add_sample(sample.value);
   }
 
+  inline size_t num_samples() const {
+    size_t result = 0;
+    for (const auto &[wavelength, average] : m_samples)
+      result += average.m_num_samples;
+    return result;
+  }
+
+  inline void merge(const SpectralPixel &other) {
+    for (const auto &[wavelength, average] : other.m_samples)
+      m_samples[wavelength].merge(average);
+  }
+
+  static constexpr uint32_t type_id = 3;
+  void write_binary(std::ostream &os) const {
+    ::write_binary<uint64_t>(os, m_samples.size());
+    for (const auto &[wavelength, average] : m_samples) {
+      ::write_binary(os, wavelength);
+      ::write_binary(os, average.m_value);
+      ::write_binary<uint64_t>(os, average.m_num_samples);
+    }
+  }
+  void read_binary(std::istream &is) {
+    uint64_t num_bins;
+    ::read_binary(is, num_bins);
+    m_samples.clear();
+    for (uint64_t i = 0; i < num_bins; ++i) {
+      real wavelength;
+      uint64_t num_samples;
+      ::read_binary(is, wavelength);
+      AverageWrapper<real> &average = m_samples[wavelength];
+      ::read_binary(is, average.m_value);
+      ::read_binary(is, num_samples);
+      average.m_num_samples = num_samples;
+    }
+  }
+
   inline Colour to_pixel() const {
     const auto combine = [](const PiecewiseLinear &intensities,
                             const PiecewiseLinear &cmf_component) {
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <optional>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// A hardware event counter for the calling thread, such as cache or TLB
+// misses. Kernels, containers and virtual machines often don't expose them, in
+// which case the counter is unavailable and stop() returns nothing.
+struct PerfCounter {
+  int fd = -1;
+
+  PerfCounter(const uint32_t type, const uint64_t config) {
+    perf_event_attr attributes;
+    std::memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    fd = ::syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+  }
+  PerfCounter(const PerfCounter &) = delete;
+  PerfCounter &operator=(const PerfCounter &) = delete;
+  ~PerfCounter() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  // Cache lines missed in the last level cache
+  static PerfCounter cache_misses() {
+    return PerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  }
+  // Data loads that missed the TLB, mostly from touching a new page
+  static PerfCounter tlb_misses() {
+    return PerfCounter(PERF_TYPE_HW_CACHE,
+                       PERF_COUNT_HW_CACHE_DTLB |
+                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  }
+
+  bool available() const { return fd >= 0; }
+
+  // Zeroes the count and starts counting
+  void start() {
+    if (fd < 0)
+      return;
+    ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  // Stops counting and returns the count since start()
+  std::optional<uint64_t> stop() {
+    if (fd < 0)
+      return std::nullopt;
+    ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count;
+    if (::read(fd, &count, sizeof(count)) != sizeof(count))
+      return std::nullopt;
+    return count;
+  }
+};
@@ -4,11 +4,46 @@
 #include "util/util.hpp"
 #include <boost/random.hpp>
 
-using generator_t = boost::random::mt11213b;
-struct RNG {
+// SplitMix64's finalizer: a cheap bijective mix with good avalanche
+constexpr inline uint64_t mix_bits(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+constexpr inline uint64_t hash_combine(const uint64_t seed,
+                                       const uint64_t value) {
+  return mix_bits(seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) +
+                          (seed >> 2)));
+}
+
+// Counter-based generator: the n-th number of a stream is a hash of the
+// stream's key and n, so independent streams cost nothing to set up and never
+// depend on which thread or in which order they are drawn
+struct CounterGenerator {
+  using result_type = uint64_t;
+  uint64_t m_key;
+  uint64_t m_counter = 0;
+
+  constexpr CounterGenerator(const uint64_t key = 0) : m_key(key) {}
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+  constexpr inline result_type operator()() {
+    return mix_bits(m_key + (++m_counter) * 0x9e3779b97f4a7c15ULL);
+  }
+};
+
+template <typename Generator> struct BasicRNG {
+  using generator_t = Generator;
   generator_t generator;
 
-  RNG(size_t seed = 0) : generator(seed) {}
+  BasicRNG(size_t seed = 0) : generator(seed) {}
 
   inline bool random_bool(const real success_probability = 0.5) {
     debug_assert(
@@ -63,3 +98,18 @@ struct RNG {
                                                   : -in_unit_sphere;
   }
 };
+
+// Used along camera paths: every (seed, pixel, sample) triple gets its own
+// stream, and each draw along the path advances that stream's counter
+struct RNG : public BasicRNG<CounterGenerator> {
+  RNG(size_t seed = 0) : BasicRNG(seed) {}
+
+  static inline RNG for_sample(const uint64_t seed, const uint64_t pixel_index,
+                               const uint64_t sample_index) {
+    return RNG(hash_combine(hash_combine(mix_bits(seed), pixel_index),
+                            sample_index));
+  }
+};
+
+// Sequential generator for building scenes, whose layout should not change
+using MersenneRNG = BasicRNG<boost::random::mt11213b>;
@@ -2,6 +2,7 @@
 #pragma once
 
 #include "util/util.hpp"
+#include <array>
 #include <optional>
 
 struct Ray {
@@ -18,3 +19,17 @@ struct Ray {
     return origin + t * direction;
   }
 };
+
+// Per-ray state BVH traversal computes once instead of at every node: slab
+// tests multiply by the inverse direction rather than dividing, and the sign
+// of each direction component says which child of a node the ray reaches
+// first along that node's split axis.
+struct PrecomputedRay {
+  vec3 origin, inv_direction;
+  std::array<uint8_t, 3> direction_is_negative;
+
+  constexpr PrecomputedRay(const Ray &ray)
+      : origin(ray.origin), inv_direction(real(1.0) / ray.direction),
+        direction_is_negative{ray.direction.x < 0.0, ray.direction.y < 0.0,
+                              ray.direction.z < 0.0} {}
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "util/ray.hpp"
+#include "util/util.hpp"
+
+#include <array>
+
+// Number of lanes in the packets the renderer traces; 4, 8 or 16 all work.
+// Set with the SPECTRAL_PACKET_SIZE CMake cache variable, which always defines
+// it.
+#ifndef SPECTRAL_PACKET_SIZE
+#error "SPECTRAL_PACKET_SIZE is not defined; configure the build with CMake"
+#endif
+constexpr size_t packet_size = SPECTRAL_PACKET_SIZE;
+static_assert(packet_size == 4 || packet_size == 8 || packet_size == 16,
+              "SPECTRAL_PACKET_SIZE must be 4, 8 or 16");
+
+// A group of rays traced together. Origins and inverse directions are kept
+// per axis and lane, so box tests run over all lanes with one vector op each.
+// Bit i of active_mask says whether lane i holds a ray.
+template <size_t N> struct RayPacket {
+  static_assert(N <= 32, "Lane masks are 32 bits wide");
+  static constexpr size_t size = N;
+
+  std::array<Ray, N> rays;
+  std::array<std::array<real, N>, 3> origins = {};
+  std::array<std::array<real, N>, 3> inv_directions = {};
+  uint32_t active_mask = 0;
+
+  inline void set_ray(const size_t lane, const Ray &ray) {
+    rays[lane] = ray;
+    for (int axis = 0; axis < 3; ++axis) {
+      origins[axis][lane] = ray.origin[axis];
+      inv_directions[axis][lane] = real(1.0) / ray.direction[axis];
+    }
+    active_mask |= 1u << lane;
+  }
+};
@@ -0,0 +1,243 @@
+#include "socket.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::string_view unix_prefix = "unix:";
+constexpr size_t max_message_size = size_t(1) << 30;
+constexpr size_t message_header_size = sizeof(uint32_t) + sizeof(uint64_t);
+constexpr int send_stall_milliseconds = 1000;
+
+[[noreturn]] void throw_socket_error(const std::string &what,
+                                     const std::string &address) {
+  throw std::runtime_error(
+      fmt::format("{} '{}': {}", what, address, std::strerror(errno)));
+}
+
+sockaddr_un unix_address(const std::string &address) {
+  const std::string path = address.substr(unix_prefix.size());
+  sockaddr_un result = {};
+  result.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(result.sun_path))
+    throw std::runtime_error(
+        fmt::format("Unix socket path '{}' is too long", path));
+  std::memcpy(result.sun_path, path.c_str(), path.size() + 1);
+  return result;
+}
+
+addrinfo *tcp_addresses(const std::string &address, const bool passive) {
+  const size_t colon = address.rfind(':');
+  if (colon == std::string::npos)
+    throw std::runtime_error(fmt::format(
+        "Address '{}' is neither host:port nor unix:path", address));
+  const std::string host = address.substr(0, colon);
+  const std::string port = address.substr(colon + 1);
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo *addresses = nullptr;
+  const int error = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                                port.c_str(), &hints, &addresses);
+  if (error != 0)
+    throw std::runtime_error(fmt::format("Could not resolve '{}': {}",
+                                         address, gai_strerror(error)));
+  return addresses;
+}
+
+} // namespace
+
+Socket &Socket::operator=(Socket &&other) {
+  if (this != &other) {
+    close();
+    m_fd = other.m_fd;
+    other.m_fd = -1;
+  }
+  return *this;
+}
+
+void Socket::close() {
+  if (m_fd >= 0)
+    ::close(m_fd);
+  m_fd = -1;
+}
+
+Socket Socket::listen(const std::string &address) {
+  Socket socket;
+  if (address.starts_with(unix_prefix)) {
+    const sockaddr_un addr = unix_address(address);
+    // A socket file left behind by an earlier run would make bind fail
+    ::unlink(addr.sun_path);
+    socket = Socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if (!socket.is_open() ||
+        ::bind(socket.m_fd, reinterpret_cast<const sockaddr *>(&addr),
+               sizeof(addr)) != 0)
+      throw_socket_error("Could not bind", address);
+  } else {
+    addrinfo *addresses = tcp_addresses(address, true);
+    for (addrinfo *ai = addresses; ai != nullptr; ai = ai->ai_next) {
+      socket = Socket(::socket(ai->ai_family, ai->ai_socktype,
+                               ai->ai_protocol));
+      if (!socket.is_open())
+        continue;
+      const int reuse = 1;
+      ::setsockopt(socket.m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                   sizeof(reuse));
+      if (::bind(socket.m_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      socket.close();
+    }
+    freeaddrinfo(addresses);
+    if (!socket.is_open())
+      throw_socket_error("Could not bind", address);
+  }
+
+  if (::listen(socket.m_fd, SOMAXCONN) != 0)
+    throw_socket_error("Could not listen on", address);
+  // Callers poll for new connections alongside the existing ones
+  ::fcntl(socket.m_fd, F_SETFL, ::fcntl(socket.m_fd, F_GETFL) | O_NONBLOCK);
+  return socket;
+}
+
+Socket Socket::connect(const std::string &address) {
+  Socket socket;
+  if (address.starts_with(unix_prefix)) {
+    const sockaddr_un addr = unix_address(address);
+    socket = Socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if (!socket.is_open() ||
+        ::connect(socket.m_fd, reinterpret_cast<const sockaddr *>(&addr),
+                  sizeof(addr)) != 0)
+      throw_socket_error("Could not connect to", address);
+    return socket;
+  }
+
+  addrinfo *addresses = tcp_addresses(address, false);
+  for (addrinfo *ai = addresses; ai != nullptr; ai = ai->ai_next) {
+    socket =
+        Socket(::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+    if (socket.is_open() &&
+        ::connect(socket.m_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    socket.close();
+  }
+  freeaddrinfo(addresses);
+  if (!socket.is_open())
+    throw_socket_error("Could not connect to", address);
+
+  // Messages are sent whole, so don't hold back their last segment
+  const int no_delay = 1;
+  ::setsockopt(socket.m_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay,
+               sizeof(no_delay));
+  return socket;
+}
+
+std::optional<Socket> Socket::accept() const {
+  const int fd = ::accept(m_fd, nullptr, nullptr);
+  if (fd < 0)
+    return std::nullopt;
+  return Socket(fd);
+}
+
+void Socket::set_nonblocking() {
+  ::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+}
+
+bool Socket::send_all(const void *data, const size_t size) const {
+  const char *bytes = static_cast<const char *>(data);
+  for (size_t sent = 0; sent < size;) {
+    // MSG_NOSIGNAL: a peer that went away is an error, not a SIGPIPE
+    const ssize_t n = ::send(m_fd, bytes + sent, size - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    // A non-blocking socket with a full send buffer gets a second to drain;
+    // a peer that stops reading for longer than that is as good as gone
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pollfd fd = {m_fd, POLLOUT, 0};
+      if (::poll(&fd, 1, send_stall_milliseconds) > 0)
+        continue;
+      return false;
+    }
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  return true;
+}
+
+bool Socket::receive_all(void *data, const size_t size) const {
+  char *bytes = static_cast<char *>(data);
+  for (size_t received = 0; received < size;) {
+    const ssize_t n = ::recv(m_fd, bytes + received, size - received, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    received += n;
+  }
+  return true;
+}
+
+bool send_message(const Socket &socket, const Message &message) {
+  const uint64_t size = message.payload.size();
+  return socket.send_all(&message.type, sizeof(message.type)) &&
+         socket.send_all(&size, sizeof(size)) &&
+         socket.send_all(message.payload.data(), message.payload.size());
+}
+
+std::optional<Message> receive_message(const Socket &socket) {
+  Message message;
+  uint64_t size = 0;
+  if (!socket.receive_all(&message.type, sizeof(message.type)) ||
+      !socket.receive_all(&size, sizeof(size)) || size > max_message_size)
+    return std::nullopt;
+  message.payload.resize(size);
+  if (!socket.receive_all(message.payload.data(), size))
+    return std::nullopt;
+  return message;
+}
+
+bool MessageReader::receive(const Socket &socket) {
+  char chunk[65536];
+  for (;;) {
+    const ssize_t n = ::recv(socket.m_fd, chunk, sizeof(chunk), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0)
+      return false;
+    m_buffer.append(chunk, n);
+  }
+
+  if (m_buffer.size() < message_header_size)
+    return true;
+  uint64_t size = 0;
+  std::memcpy(&size, m_buffer.data() + sizeof(uint32_t), sizeof(size));
+  return size <= max_message_size;
+}
+
+std::optional<Message> MessageReader::next() {
+  if (m_buffer.size() < message_header_size)
+    return std::nullopt;
+  Message message;
+  uint64_t size = 0;
+  std::memcpy(&message.type, m_buffer.data(), sizeof(message.type));
+  std::memcpy(&size, m_buffer.data() + sizeof(uint32_t), sizeof(size));
+  if (m_buffer.size() - message_header_size < size)
+    return std::nullopt;
+  message.payload = m_buffer.substr(message_header_size, size);
+  m_buffer.erase(0, message_header_size + size);
+  return message;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "util/util.hpp"
+
+#include <optional>
+#include <string>
+
+// A connected or listening stream socket that closes itself. Addresses are
+// either "host:port" for TCP, or "unix:/path/to/socket" for a Unix domain
+// socket, which is handy for running several processes on one machine.
+struct Socket {
+  int m_fd = -1;
+
+  Socket() = default;
+  explicit Socket(const int fd) : m_fd(fd) {}
+  Socket(Socket &&other) : m_fd(other.m_fd) { other.m_fd = -1; }
+  Socket &operator=(Socket &&other);
+  Socket(const Socket &) = delete;
+  Socket &operator=(const Socket &) = delete;
+  ~Socket() { close(); }
+
+  static Socket listen(const std::string &address);
+  // Throws if nothing is listening at address
+  static Socket connect(const std::string &address);
+
+  inline bool is_open() const { return m_fd >= 0; }
+  void close();
+
+  // Returns nullopt if no connection is waiting
+  std::optional<Socket> accept() const;
+  // Makes reads return at once when nothing has arrived, so one thread can
+  // serve many peers; see MessageReader
+  void set_nonblocking();
+
+  // Both return false once the connection is closed or broken
+  bool send_all(const void *data, const size_t size) const;
+  bool receive_all(void *data, const size_t size) const;
+};
+
+// Messages are a type, a payload size and the payload, so either end can
+// frame them without knowing what they contain
+struct Message {
+  uint32_t type = 0;
+  std::string payload;
+};
+
+bool send_message(const Socket &socket, const Message &message);
+// Returns nullopt once the connection is closed or broken
+std::optional<Message> receive_message(const Socket &socket);
+
+// Reassembles messages from a non-blocking socket as their bytes arrive, so a
+// peer that stalls mid-message never holds up whoever is polling it
+struct MessageReader {
+  std::string m_buffer;
+
+  // Buffers whatever the socket has ready without waiting for more. Returns
+  // false once the connection is closed or broken, or announces a message
+  // too large to be real.
+  bool receive(const Socket &socket);
+  // Removes and returns the oldest complete message, if one has arrived
+  std::optional<Message> next();
+  // Whether part of a message is waiting for the rest
+  inline bool partial() const { return !m_buffer.empty(); }
+};
@@ -51,5 +51,5 @@ inline real rgb_to_spectral(const Colour &colour, const real wavelength) {
         conversion_spectra[static_cast<size_t>(spectrum_type)][i];
     result += piecewise_linear.at(wavelength) * weights[i];
   }
-  return glm::clamp(result, 0.0, 1.0);
+  return glm::clamp(result, real(0.0), real(1.0));
 }
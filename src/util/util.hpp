@@ -1,10 +1,12 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -16,11 +18,26 @@
 #include "stb_image.h"
 #include "stb_image_write.h"
 
+// Whether real, and the vectors and matrices built on it, are float rather
+// than double. Single precision halves the size of vectors, rays, boxes and
+// hit records, and doubles how many fit in a SIMD register; the few
+// calculations that cancel too badly in float use precise_real instead.
+#ifndef SPECTRAL_SINGLE_PRECISION
+#define SPECTRAL_SINGLE_PRECISION 0
+#endif
+
+#if SPECTRAL_SINGLE_PRECISION
+using real = float;
+#else
 using real = double;
+#endif
+using precise_real = double;
 using vec2 = glm::vec<2, real, glm::defaultp>;
 using vec3 = glm::vec<3, real, glm::defaultp>;
 using vec4 = glm::vec<4, real, glm::defaultp>;
+using mat3 = glm::mat<3, 3, real, glm::defaultp>;
 using mat4 = glm::mat<4, 4, real, glm::defaultp>;
+using precise_vec3 = glm::vec<3, precise_real, glm::defaultp>;
 using Colour = vec3;
 
 #ifdef NDEBUG
@@ -51,15 +68,39 @@ constexpr inline bool near_zero(const real num) {
   return std::abs(num) < 2 * std::numeric_limits<real>::epsilon();
 }
 
+inline size_t default_num_threads() {
+  return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+// Calls body(chunk, chunk_start, chunk_end) for num_chunks contiguous chunks
+// of [start_idx, end_idx), each on its own thread; the last chunk runs on the
+// calling thread
+template <typename Body>
+inline void for_each_chunk(const size_t start_idx, const size_t end_idx,
+                           const size_t num_chunks, const Body &body) {
+  const size_t num_items = end_idx - start_idx;
+  std::vector<std::thread> threads;
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+    const size_t chunk_start = start_idx + chunk * num_items / num_chunks;
+    const size_t chunk_end = start_idx + (chunk + 1) * num_items / num_chunks;
+    if (chunk + 1 < num_chunks)
+      threads.emplace_back(body, chunk, chunk_start, chunk_end);
+    else
+      body(chunk, chunk_start, chunk_end);
+  }
+  for (auto &thread : threads)
+    thread.join();
+}
+
 template <typename T>
 constexpr inline T lerp(const T a, const T b, const real t) {
-  return (1.0 - t) * a + t * b;
+  return (real(1.0) - t) * a + t * b;
 }
 
 constexpr inline vec3 remove_nans(const vec3 &v) {
-  return vec3(std::isnan(v.x) ? 0.0 : v.x,  //
-              std::isnan(v.y) ? 0.0 : v.y,  //
-              std::isnan(v.z) ? 0.0 : v.z); //
+  return vec3(std::isnan(v.x) ? real(0.0) : v.x,  //
+              std::isnan(v.y) ? real(0.0) : v.y,  //
+              std::isnan(v.z) ? real(0.0) : v.z); //
 }
 
 template <> struct fmt::formatter<vec3> : formatter<std::string_view> {